@@ -3,6 +3,24 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <assert.h>
 
 int worldseed = 0;
 
@@ -74,7 +92,7 @@ Oreinfo ores[N_ORES] =
 };
 // the frequencies and amounts are set dynamically later, depending on the tier
 
-int ore_frequencies[N_ORES]; // still around, cause it's more convenient for weighed_rand()
+int ore_frequencies[N_ORES]; // still around, cause it's more convenient for picking ore types
 
 #define MAX_TIERS 6
 int tier_ores[MAX_TIERS][N_CATEGORIES] =
@@ -88,21 +106,74 @@ int tier_ores[MAX_TIERS][N_CATEGORIES] =
 {	STONE,	ALUMINUM,	PLATINUM,	MOONSTONE,	OPAL},
 };
 
+// with ore veins on(--veins), ores come in clumps instead of one tile at a time
+int vein_size[MAX_TIERS][N_CATEGORIES] = // how wide a vein roughly is, in tiles(a power of two)
+{
+//	RUBBLE	MASS	MAIN	RARE	SRARE
+{	16,	8,	8,	4,	2},
+{	16,	8,	8,	4,	2},
+{	16,	8,	8,	4,	2},
+{	16,	8,	8,	4,	2},
+{	16,	8,	8,	4,	2},
+{	16,	8,	8,	4,	2},
+};
+int vein_density[MAX_TIERS][N_CATEGORIES] = // tiles per 10000 that are this category's ore
+{
+//	RUBBLE	MASS	MAIN	RARE	SRARE
+{	32,	38,	26,	3,	1},
+{	32,	38,	26,	3,	1},
+{	32,	38,	26,	3,	1},
+{	32,	38,	26,	3,	1},
+{	32,	38,	26,	3,	1},
+{	32,	38,	26,	3,	1},
+};
+
 Color tier_colors[MAX_TIERS+1] = // including 0th tier, aka the surface
 {GREEN, BROWN, DARKGREEN, BLUE, MAROON, DARKBROWN, DARKBLUE};
 
 float tier_seal_dps[MAX_TIERS] = {6.03, 9.67, 15.95, 24.40, 36.10, 52.55}; // seal stone DPS check for each tier
 
-int weighed_rand(int *prob_distribution, int width)
+//					RUBBLE	MASS	MAIN	RARE	SRARE
+int category_frequency[N_CATEGORIES] =	{50,	60,	40,	4,	2};
+int category_amount[N_CATEGORIES] =	{10000,	500,	100,	5,	2};
+
+char ore_veins = 0;
+
+#define ORE_CHANCE 100 // one in this many tiles is an ore
+#define STAIRS_PER_FLOOR 5 // how many stairs/entrances each floor has
+
+int next_tier_chance(int mine_floor)
+// chance of a staircase being a mine entrance instead, measured in
+// promils(1/1000) instead of percents for greater precision
 {
-	int sum = 0, i;
-	for(i = 0; i < width; i++) sum += prob_distribution[i];
-	int n = rand()%sum;
-	sum = 0;
-	for(i = 0; sum <= n; i++) sum += prob_distribution[i];
-	return i-1;
+	if(mine_floor > 10)
+		return (mine_floor-10)*10;
+	return 0;
+}
+
+// what the upgrade levels translate to
+float speed_to_delay(int level) { return 1.0 / (1.0+level*0.05); } //+5% to the boost of speed per upgrade
+float power_to_damage(int level) { return 2.0 * (1.0 + level*0.05); }
+float skill_to_multiplier(int level) { return 1.0 + level*0.05; }
+
+int upgrade_cost(int level, int total_level)
+{
+	return 2 * level * level + total_level;
 }
 
+#ifdef __GLIBC__
+// rand() takes a lock on every call, which was most of generate_floor()'s
+// time; random_r() is the very same generator minus the lock, so the floors
+// come out identical
+struct random_data floor_rng;
+char floor_rng_state[128]; // the size rand() uses
+void floor_srand(unsigned int seed) { initstate_r(seed, floor_rng_state, sizeof(floor_rng_state), &floor_rng); }
+int floor_rand() { int32_t n; random_r(&floor_rng, &n); return n; }
+#else
+#define floor_srand srand
+#define floor_rand rand
+#endif
+
 typedef struct
 {
 	int type;
@@ -112,6 +183,8 @@ typedef struct
 } Ore;
 
 Ore **ore_map;
+int **miner_slot; // which job mines each tile, +1; 0 for none(see add_miner())
+unsigned short **journal_slot; // where each tile's record is in the journal's batch; 0 for none(see journal_tile())
 
 // Window dimensions
 #define WID 800
@@ -173,9 +246,33 @@ Rectangle player = {0, 0, 49*SCALE/50, 49*SCALE/50}; // x, y, w, h
 
 // Player camera
 Camera2D camera = {0};
+#define MIN_ZOOM 0.05
+#define MAX_ZOOM 2.0
+
+// level of detail: below these zoom levels, tiles get drawn simpler
+#define LOD_FLAT_ZOOM 0.5 // ores as one flat color, no vein dots
+#define LOD_OVERVIEW_ZOOM 0.15 // the whole floor as one texture(the minimap's)
 
 int coins = 0;
 
+// Counters about the running game, copied out to shared memory once a frame
+// for --watch to show(see publish_telemetry())
+typedef struct
+{
+	long long frames;
+	float frame_ms, worst_frame_ms; // the last frame, and the worst one in the last second
+	long long ores_mined[N_ORES]; // pieces, per ore type
+	long long coins_earned;
+	float coins_per_minute; // over the last minute
+	long long floor_transitions;
+	long long floor_bytes_written, floor_bytes_read; // by save_floor() and load_floor()
+	long long floors_generated;
+	float generate_ms, generate_ms_total; // the last floor, and all of them
+	long long journal_commits, journal_bytes, journal_checkpoints;
+	int mine_floor, tier;
+} Telemetry;
+Telemetry telemetry = {0};
+
 void Draw8by8dot(int x, int y, int dx, int dy, Color c)
 // x, y - tile coords; dx, dy - dot coords;
 {
@@ -203,10 +300,24 @@ void DrawOre(int x, int y, int type, char mined)
 	Draw8by8dot(x, y, 7, 7, fg);
 }
 
+void visible_tiles(int *x0, int *y0, int *x1, int *y1) // the tiles on screen, x1 and y1 not included
+{
+	Vector2 topleft = GetScreenToWorld2D((Vector2){0, 0}, camera);
+	Vector2 bottomright = GetScreenToWorld2D((Vector2){WID, HEI}, camera);
+	*x0 = Clamp(topleft.x/SCALE - 1, 0, object_tiles.wid);
+	*y0 = Clamp(topleft.y/SCALE - 1, 0, object_tiles.hei);
+	*x1 = Clamp(bottomright.x/SCALE + 1, 0, object_tiles.wid);
+	*y1 = Clamp(bottomright.y/SCALE + 1, 0, object_tiles.hei);
+}
+
 void DrawObjectTiles(int2 mined_tile, float time_since_last_mined)
 {
-	for(int x = 0; x < object_tiles.wid; x++)
-	for(int y = 0; y < object_tiles.hei; y++)
+	int x0, y0, x1, y1;
+	visible_tiles(&x0, &y0, &x1, &y1); // only what's on screen
+	char flat = camera.zoom < LOD_FLAT_ZOOM;
+
+	for(int x = x0; x < x1; x++)
+	for(int y = y0; y < y1; y++)
 	{
 		Color c;
 		switch(object_tiles.tiles[x][y])
@@ -224,7 +335,10 @@ void DrawObjectTiles(int2 mined_tile, float time_since_last_mined)
 					mined = 0;
 				// the animation only lasts 1/5 of the mining cycle
 
-				DrawOre(x, y, ore_map[x][y].type, mined);
+				if(flat)
+					DrawRectangle(x*SCALE, y*SCALE, SCALE, SCALE, ores[ore_map[x][y].type].fg);
+				else
+					DrawOre(x, y, ore_map[x][y].type, mined);
 			default: continue;
 		}
 		if(object_tiles.tiles[x][y] != ORE)
@@ -232,17 +346,114 @@ void DrawObjectTiles(int2 mined_tile, float time_since_last_mined)
 	}
 }
 
+// HUD widgets are drawn into their own texture, and only redrawn when one
+// of the values they show changes; most frames they're a single quad each.
+
+#define HUD_MAX_KEY 8
+typedef struct
+{
+	RenderTexture2D tex;
+	long long key[HUD_MAX_KEY]; // the values it was last drawn with
+	char drawn;
+} HudWidget;
+
+enum HUD_WIDGETS {HUD_COINS, HUD_UPGRADES, HUD_FLOOR, HUD_MINING, N_HUD_WIDGETS};
+HudWidget hud[N_HUD_WIDGETS] = {0};
+
+char BeginHudWidget(HudWidget *w, long long *key, int nkey, int wid, int hei)
+// if the values changed, starts drawing the widget anew and returns 1;
+// EndHudWidget() has to follow in that case
+{
+	if(w->drawn)
+	{
+		int i;
+		for(i = 0; i < nkey; i++)
+			if(w->key[i] != key[i]) break;
+		if(i == nkey) return 0;
+	}
+	else w->tex = LoadRenderTexture(wid, hei);
+
+	for(int i = 0; i < nkey; i++)
+		w->key[i] = key[i];
+	w->drawn = 1;
+	BeginTextureMode(w->tex);
+	ClearBackground(BLANK);
+	return 1;
+}
+
+void EndHudWidget()
+{
+	EndTextureMode();
+}
+
+void DrawHudWidget(HudWidget *w, int x, int y)
+{
+	Rectangle src = {0, 0, w->tex.texture.width, -w->tex.texture.height}; // render textures are upside down
+	DrawTextureRec(w->tex.texture, src, (Vector2){x, y}, WHITE);
+}
+
+void UnloadHud()
+{
+	for(int i = 0; i < N_HUD_WIDGETS; i++)
+		if(hud[i].drawn)
+		{
+			UnloadRenderTexture(hud[i].tex);
+			hud[i].drawn = 0;
+		}
+}
+
 #define COIN_WIDGET_SCALE 20
 void DisplayCoins()
 {
-	DrawCircle(COIN_WIDGET_SCALE, COIN_WIDGET_SCALE, COIN_WIDGET_SCALE, YELLOW);
-	DrawText(TextFormat("%d", coins), COIN_WIDGET_SCALE*2 + 5, 0, COIN_WIDGET_SCALE*2, WHITE);
+	long long key[] = {coins};
+	if(BeginHudWidget(&hud[HUD_COINS], key, 1, WID, COIN_WIDGET_SCALE*2))
+	{
+		DrawCircle(COIN_WIDGET_SCALE, COIN_WIDGET_SCALE, COIN_WIDGET_SCALE, YELLOW);
+		DrawText(TextFormat("%d", coins), COIN_WIDGET_SCALE*2 + 5, 0, COIN_WIDGET_SCALE*2, WHITE);
+		EndHudWidget();
+	}
+	DrawHudWidget(&hud[HUD_COINS], 0, 0);
+}
+
+void DisplayFloor()
+{
+	long long key[] = {mine_floor};
+	if(BeginHudWidget(&hud[HUD_FLOOR], key, 1, WID/3, 20))
+	{
+		DrawText(TextFormat("Floor: %d", mine_floor), 0, 0, 20, WHITE);
+		EndHudWidget();
+	}
+	DrawHudWidget(&hud[HUD_FLOOR], 0, HEI-20);
+}
+
+void DisplayMiningTarget(char *ore_name, int amount) // the "Ore x amount" line
+{
+	long long key[] = {(long long)(size_t)ore_name, amount};
+	if(BeginHudWidget(&hud[HUD_MINING], key, 2, WID*2/3, 20))
+	{
+		DrawText(TextFormat("%s x %d", ore_name, amount), 0, 0, 20, YELLOW);
+		EndHudWidget();
+	}
+	DrawHudWidget(&hud[HUD_MINING], WID/3, HEI-20);
+}
+
+void tiles_around(Rectangle a, Rectangle b, int *x0, int *y0, int *x1, int *y1)
+// the tiles both rectangles cover, and one more all around; x1 and y1 not included
+{
+	*x0 = Clamp(floorf(fminf(a.x, b.x)/SCALE) - 1, 0, object_tiles.wid);
+	*y0 = Clamp(floorf(fminf(a.y, b.y)/SCALE) - 1, 0, object_tiles.hei);
+	*x1 = Clamp(floorf(fmaxf(a.x+a.width, b.x+b.width)/SCALE) + 2, 0, object_tiles.wid);
+	*y1 = Clamp(floorf(fmaxf(a.y+a.height, b.y+b.height)/SCALE) + 2, 0, object_tiles.hei);
 }
 
 void collide_with_walls(Rectangle *player, Rectangle oldrec)
 {
-	for(int y = 0; y < object_tiles.hei; y++)
-	for(int x = 0; x < object_tiles.wid; x++)
+	// a step moves the player less than a tile, and getting pushed out of a
+	// wall only puts it next to that wall, so only the tiles around can touch
+	int x0, y0, x1, y1;
+	tiles_around(*player, oldrec, &x0, &y0, &x1, &y1);
+	for(int y = y0; y < y1; y++)
+	for(int x = x0; x < x1; x++)
 	{
 		if(object_tiles.tiles[x][y] == EMPTY) continue;
 		if(object_tiles.tiles[x][y] == STAIRS) continue;
@@ -276,12 +487,14 @@ void collide_with_walls(Rectangle *player, Rectangle oldrec)
 	}
 }
 
-char touches_stairs(Rectangle rec, int2 *pos)
+char touches_tile(Rectangle rec, int tile, int2 *pos) // the first such tile rec overlaps
 {
-	for(int x = 0; x < object_tiles.wid; x++)
-	for(int y = 0; y < object_tiles.hei; y++)
+	int x0, y0, x1, y1;
+	tiles_around(rec, rec, &x0, &y0, &x1, &y1);
+	for(int x = x0; x < x1; x++)
+	for(int y = y0; y < y1; y++)
 	{
-		if(object_tiles.tiles[x][y] != STAIRS) continue;
+		if(object_tiles.tiles[x][y] != tile) continue;
 		Rectangle tilerec = (Rectangle){x*SCALE, y*SCALE, SCALE, SCALE};
 		if(CheckCollisionRecs(rec, tilerec))
 		{
@@ -292,35 +505,118 @@ char touches_stairs(Rectangle rec, int2 *pos)
 	return 0;
 }
 
+char touches_stairs(Rectangle rec, int2 *pos)
+{
+	return touches_tile(rec, STAIRS, pos);
+}
+
 char touches_upstairs(Rectangle rec)
 {
-	for(int x = 0; x < object_tiles.wid; x++)
-	for(int y = 0; y < object_tiles.hei; y++)
-	{
-		if(object_tiles.tiles[x][y] != UPSTAIRS) continue;
-		Rectangle tilerec = (Rectangle){x*SCALE, y*SCALE, SCALE, SCALE};
-		if(CheckCollisionRecs(rec, tilerec))
-			return 1;
-	}
-	return 0;
+	int2 pos;
+	return touches_tile(rec, UPSTAIRS, &pos);
 }
 
 char touches_entrance(Rectangle rec, int2 *pos)
 {
-	for(int x = 0; x < object_tiles.wid; x++)
-	for(int y = 0; y < object_tiles.hei; y++)
-	{
-		if(object_tiles.tiles[x][y] != ENTRANCE) continue;
-		Rectangle tilerec = (Rectangle){x*SCALE, y*SCALE, SCALE, SCALE};
-		if(CheckCollisionRecs(rec, tilerec))
-		{
-			pos->x = x; pos->y = y;
-			return 1;
-		}
-	}
-	return 0;
+	return touches_tile(rec, ENTRANCE, pos);
+}
+
+// Tile changes: everything that changes a tile or its ore goes through
+// set_tile(), set_ore() or set_ore_state(), which log a TileEvent into a ring.
+// Whatever keeps something built from the tiles(the minimap, the distance
+// fields, the server's clients) reads the events it hasn't seen yet with its
+// own cursor, instead of rescanning the floor or being called from every place
+// that changes a tile. A whole new floor is a single event for everyone:
+// start over from the floor itself. So is falling more than the ring behind.
+// That's why generating or loading a floor writes the tiles directly: its
+// events would be thrown away by floor_replaced() right after.
+
+typedef struct
+{
+	unsigned short x, y;
+	signed char old_tile, tile;
+	short old_type, type; // the ore type, -1 if the tile isn't an ore
+	int amount; // the ore's, after the change
+	float wear, regen;
+} TileEvent;
+
+#define TILE_EVENTS 4096 // a power of two
+TileEvent tile_events[TILE_EVENTS];
+long long tile_events_head = 0; // how many events were ever logged
+int tile_events_floor = 0; // bumped for every whole new floor
+long long tile_events_floor_start = 0; // the first event on the current floor
+
+typedef struct
+{
+	long long next; // the next event to read
+	int floor;
+} TileCursor;
+
+void log_tile_event(int x, int y, int old_tile, int old_type)
+{
+	TileEvent *e = &tile_events[tile_events_head++ & (TILE_EVENTS-1)];
+	Ore *o = &ore_map[x][y];
+	e->x = x; e->y = y;
+	e->old_tile = old_tile;
+	e->tile = object_tiles.tiles[x][y];
+	e->old_type = old_type;
+	e->type = e->tile == ORE ? o->type : -1;
+	e->amount = o->amount;
+	e->wear = o->wear;
+	e->regen = o->regen;
+}
+
+void set_tile(int x, int y, int tile) // for anything but ores
+{
+	int old = object_tiles.tiles[x][y];
+	object_tiles.tiles[x][y] = tile;
+	log_tile_event(x, y, old, old == ORE ? ore_map[x][y].type : -1);
+}
+
+void set_ore(int x, int y, int type, int amount, float wear, float regen)
+{
+	int old = object_tiles.tiles[x][y];
+	Ore *o = &ore_map[x][y];
+	int old_type = old == ORE ? o->type : -1;
+	object_tiles.tiles[x][y] = ORE;
+	*o = (Ore){type, amount, regen, wear};
+	log_tile_event(x, y, old, old_type);
+}
+
+void set_ore_state(int x, int y, int amount, float wear) // an ore getting mined or regenerating
+{
+	Ore *o = &ore_map[x][y];
+	if(o->amount == amount && o->wear == wear) return;
+	o->amount = amount;
+	o->wear = wear;
+	log_tile_event(x, y, ORE, o->type);
+}
+
+void floor_replaced() // after loading or generating a whole floor
+{
+	tile_events_floor++;
+	tile_events_floor_start = tile_events_head;
+}
+
+char tile_events_lost(TileCursor *c) // whether the consumer has to start over from the whole floor
+{
+	return c->floor != tile_events_floor || tile_events_head - c->next > TILE_EVENTS;
+}
+
+TileEvent *next_tile_event(TileCursor *c) // NULL once caught up
+{
+	if(c->next == tile_events_head) return NULL;
+	return &tile_events[c->next++ & (TILE_EVENTS-1)];
 }
 
+void skip_tile_events(TileCursor *c) // after starting over
+{
+	c->next = tile_events_head;
+	c->floor = tile_events_floor;
+}
+
+int placement_tries = 0; // how many random spots place_random_*() tried, for --seeds
+
 char is_9by9_obstructed(int center_x, int center_y)
 {
 	for(int i = -1; i <= 1; i++)
@@ -344,18 +640,16 @@ void place_random_entrance()
 	int ent_x = 0, ent_y = 0;
 	while(is_9by9_obstructed(ent_x, ent_y))
 	{
-		ent_x = 1 + rand()%(object_tiles.wid-2);
-		ent_y = 1 + rand()%(object_tiles.hei-2);
+		ent_x = 1 + floor_rand()%(object_tiles.wid-2);
+		placement_tries++;
+		ent_y = 1 + floor_rand()%(object_tiles.hei-2);
 	}
 	for(int i = -1; i <= 1; i++)
 	for(int j = -1; j <= 1; j++)
 			object_tiles.tiles[ent_x+i][ent_y+j] = WALL;
 	object_tiles.tiles[ent_x][ent_y] = ENTRANCE;
 	object_tiles.tiles[ent_x][ent_y+1] = ORE;
-	ore_map[ent_x][ent_y+1].type = SEAL;
-	ore_map[ent_x][ent_y+1].amount = 1;
-	ore_map[ent_x][ent_y+1].wear = mining_damage*2;
-	ore_map[ent_x][ent_y+1].regen = tier_seal_dps[tier-1];
+	ore_map[ent_x][ent_y+1] = (Ore){SEAL, 1, tier_seal_dps[tier-1], mining_damage*2};
 }
 
 void place_random_stairs()
@@ -363,8 +657,9 @@ void place_random_stairs()
 	int stairs_x = 0, stairs_y = 0;
 	while(is_9by9_obstructed(stairs_x, stairs_y))
 	{
-		stairs_x = 1 + rand()%(object_tiles.wid-2);
-		stairs_y = 1 + rand()%(object_tiles.hei-2);
+		stairs_x = 1 + floor_rand()%(object_tiles.wid-2);
+		placement_tries++;
+		stairs_y = 1 + floor_rand()%(object_tiles.hei-2);
 	}
 	for(int i = -1; i <= 1; i++)
 	for(int j = -1; j <= 1; j++)
@@ -378,8 +673,9 @@ void place_random_upstairs()
 	int stairs_x = 0, stairs_y = 0;
 	while(is_9by9_obstructed(stairs_x, stairs_y))
 	{
-		stairs_x = 1 + rand()%(object_tiles.wid-2);
-		stairs_y = 1 + rand()%(object_tiles.hei-2);
+		stairs_x = 1 + floor_rand()%(object_tiles.wid-2);
+		placement_tries++;
+		stairs_y = 1 + floor_rand()%(object_tiles.hei-2);
 	}
 	for(int i = -1; i <= 1; i++)
 	for(int j = -1; j <= 1; j++)
@@ -388,6 +684,176 @@ void place_random_upstairs()
 	object_tiles.tiles[stairs_x][stairs_y-1] = EMPTY;
 }
 
+// Ore veins: every ore category gets its own field of value noise(random
+// values on a lattice, blended smoothly, with a few octaves of it added up)
+// and the tiles where the field is highest become that category's ore.
+// It's all integer math in plain loops that vectorize, so a field comes out
+// exactly the same whatever the SIMD width(or with none at all).
+#define VEIN_OCTAVES 3 // each one half the size and half the weight of the last
+#define NOISE_BITS 12 // lattice values and blend weights are 12 bit fixed point
+#define VEIN_BINS 1024
+
+int *vein_field = NULL; int vein_field_size = 0;
+int *vein_columns = NULL; int vein_columns_size = 0; // two lattice columns, for vein_noise()
+
+static inline int lattice_value(unsigned x, unsigned y, unsigned seed)
+{
+	unsigned h = x*0x27d4eb2dU ^ y*0x165667b1U ^ seed;
+	h ^= h >> 15; h *= 0x2c1b3c6dU; h ^= h >> 12;
+	return h >> (32-NOISE_BITS);
+}
+
+static inline int smoothstep(int f) // 3f^2 - 2f^3
+{
+	int f2 = f*f >> NOISE_BITS;
+	return (f2*(3<<NOISE_BITS) - 2*f2*f) >> NOISE_BITS;
+}
+
+void lattice_column(int *restrict v, int hei, int s, unsigned x0, unsigned seed)
+// the lattice values of one column, already blended along it
+{
+	for(int y = 0; y < hei; y++)
+	{
+		unsigned y0 = y >> s;
+		int wy = smoothstep((y & ((1<<s)-1)) << (NOISE_BITS-s));
+		int a = lattice_value(x0, y0, seed), b = lattice_value(x0, y0+1, seed);
+		v[y] = a + ((b-a)*wy >> NOISE_BITS);
+	}
+}
+
+void vein_noise(int *restrict field, int wid, int hei, int size_log2, unsigned seed)
+// field[x*hei + y], laid out like the tile columns
+{
+	if(vein_columns_size < 2*hei)
+	{
+		vein_columns_size = 2*hei;
+		vein_columns = realloc(vein_columns, sizeof(int)*vein_columns_size);
+	}
+
+	memset(field, 0, sizeof(int)*wid*hei);
+	for(int o = 0; o < VEIN_OCTAVES && size_log2 - o >= 0; o++)
+	{
+		int s = size_log2 - o, shift = VEIN_OCTAVES-1 - o;
+		unsigned oseed = seed + o*0x9e3779b9U;
+
+		// Blending is done along the columns first, for the two lattice
+		// columns on either side; then every tile column between them is
+		// just a blend of those two, which is the part that runs for every tile.
+		int *left = vein_columns, *right = vein_columns + hei;
+		lattice_column(left, hei, s, 0, oseed);
+		lattice_column(right, hei, s, 1, oseed);
+		for(int x = 0; x < wid; x++)
+		{
+			if(x > 0 && (x & ((1<<s)-1)) == 0) // crossed into the next lattice cell
+			{
+				int *t = left; left = right; right = t;
+				lattice_column(right, hei, s, (x >> s) + 1, oseed);
+			}
+			int wx = smoothstep((x & ((1<<s)-1)) << (NOISE_BITS-s));
+			int *restrict col = field + x*hei;
+			const int *restrict l = left, *restrict r = right;
+			for(int y = 0; y < hei; y++)
+				col[y] += (l[y] + ((r[y]-l[y])*wx >> NOISE_BITS)) << shift;
+		}
+	}
+}
+
+int vein_threshold(const int *field, int n, int tiles)
+// the lowest value that only about the top `tiles` tiles reach
+{
+	if(tiles <= 0) return 1 << (NOISE_BITS+VEIN_OCTAVES); // above anything in the field
+	int bins[VEIN_BINS] = {0}, bin_shift = NOISE_BITS+VEIN_OCTAVES - 10; // 2^10 == VEIN_BINS
+	for(int i = 0; i < n; i++)
+		bins[field[i] >> bin_shift]++;
+
+	int count = 0, b = VEIN_BINS-1;
+	while(b > 0 && (count += bins[b]) < tiles) b--;
+	return b << bin_shift;
+}
+
+void place_ore_veins(unsigned seed)
+{
+	int wid = object_tiles.wid, hei = object_tiles.hei;
+	if(vein_field_size < wid*hei)
+	{
+		vein_field_size = wid*hei;
+		vein_field = realloc(vein_field, sizeof(int)*vein_field_size);
+	}
+
+	for(int x = 0; x < wid; x++)
+		for(int y = 0; y < hei; y++)
+			object_tiles.tiles[x][y] = EMPTY;
+
+	for(int c = 0; c < N_CATEGORIES; c++) // rarer categories come later and end up on top
+	{
+		int size_log2 = 0;
+		while((2 << size_log2) <= vein_size[tier-1][c]) size_log2++;
+		vein_noise(vein_field, wid, hei, size_log2, seed*0x85ebca6bU + c*0x9e3779b9U);
+		int threshold = vein_threshold(vein_field, wid*hei, vein_density[tier-1][c]*wid*hei/10000);
+
+		int type = tier_ores[tier-1][c];
+		for(int x = 0; x < wid; x++)
+		for(int y = 0; y < hei; y++)
+			if(vein_field[x*hei + y] >= threshold)
+			{
+				object_tiles.tiles[x][y] = ORE;
+				ore_map[x][y].type = type;
+				ore_map[x][y].amount = ores[type].amount;
+				ore_map[x][y].wear = ores[type].durability;
+				ore_map[x][y].regen = 0;
+			}
+	}
+}
+
+int run_vein_bench(int argc, char **argv) // --vein-bench [size] [repeats], times one noise field
+{
+	int size = argc > 0 ? atoi(argv[0]) : 1000, repeats = argc > 1 ? atoi(argv[1]) : 20;
+	if(size <= 0 || repeats <= 0) return 1;
+	vein_field = malloc(sizeof(int)*size*size);
+
+	unsigned long long h = 14695981039346656037ULL;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < repeats; i++)
+	{
+		vein_noise(vein_field, size, size, 4, i);
+		h = (h ^ vein_field[i % (size*size)]) * 1099511628211ULL; // so it can't be optimized out
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+
+	for(int i = 0; i < size*size; i++) // the checksum of the last field, to compare builds with
+		h = (h ^ vein_field[i]) * 1099511628211ULL;
+	printf("%dx%d noise field(%d octaves): %.2f ms, checksum %016llx\n", size, size, VEIN_OCTAVES, 1000*t/repeats, h);
+	return 0;
+}
+
+void place_scattered_ores() // each tile on its own: one in ORE_CHANCE is an ore, of a type picked by frequency
+{
+	for(int x = 0; x < object_tiles.wid; x++)
+	{
+		for(int y = 0; y < object_tiles.hei; y++)
+			object_tiles.tiles[x][y] = floor_rand()%ORE_CHANCE?EMPTY:ORE;
+	}
+	int cumulative[N_ORES], sum = 0;
+	for(int i = 0; i < N_ORES; i++)
+		cumulative[i] = sum += ore_frequencies[i];
+	// weighed random pick, with the frequencies added up once instead of for every tile
+
+	for(int x = 0; x < object_tiles.wid; x++)
+	{
+		for(int y = 0; y < object_tiles.hei; y++)
+		{
+			int n = floor_rand()%sum, type = 0;
+			while(cumulative[type] <= n) type++;
+			ore_map[x][y].type = type;
+			ore_map[x][y].amount = ores[ore_map[x][y].type].amount;
+			ore_map[x][y].wear = ores[ore_map[x][y].type].durability;
+			ore_map[x][y].regen = 0; // normal ores don't regenerate(for now)
+		}
+	}
+}
+
 void generate_floor()
 {
 	if(depth <= 0) // surface
@@ -403,25 +869,19 @@ void generate_floor()
 		return;
 	}
 
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	for(int i = 0; i < N_ORES; i++)
 		ores[i].frequency = 0;
 	for(int i = 0; i < N_ORES; i++)
 		ores[i].amount = 0;
 
-	ores[tier_ores[tier-1][RUBBLE]].frequency = 50;
-	ores[tier_ores[tier-1][RUBBLE]].amount = 10000;
-
-	ores[tier_ores[tier-1][MASS]].frequency = 60;
-	ores[tier_ores[tier-1][MASS]].amount = 500;
-
-	ores[tier_ores[tier-1][MAIN]].frequency = 40;
-	ores[tier_ores[tier-1][MAIN]].amount = 100;
-
-	ores[tier_ores[tier-1][RARE]].frequency = 4;
-	ores[tier_ores[tier-1][RARE]].amount = 5;
-
-	ores[tier_ores[tier-1][SRARE]].frequency = 2;
-	ores[tier_ores[tier-1][SRARE]].amount = 2;
+	for(int i = 0; i < N_CATEGORIES; i++)
+	{
+		ores[tier_ores[tier-1][i]].frequency = category_frequency[i];
+		ores[tier_ores[tier-1][i]].amount = category_amount[i];
+	}
 
 	for(int i = 0; i < N_ORES; i++)
 		ore_frequencies[i] = ores[i].frequency;
@@ -429,38 +889,150 @@ void generate_floor()
 	int seed = worldseed;
 	for(int i = 0; i < depth; i++)
 		seed ^= path[i].x ^ path[i].y ^ path[i].z ^ path[i].stairs;
-	srand(seed);
+	floor_srand(seed);
+
+	if(ore_veins)
+		place_ore_veins(seed);
+	else
+		place_scattered_ores();
+
+	for(int i = 0; i < STAIRS_PER_FLOOR; i++)
+		if(floor_rand()%1000 < next_tier_chance(mine_floor))
+			place_random_entrance();
+		else
+			place_random_stairs();
+
+	place_random_upstairs();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	telemetry.generate_ms = (end.tv_sec - start.tv_sec)*1e3 + (end.tv_nsec - start.tv_nsec)/1e6;
+	telemetry.generate_ms_total += telemetry.generate_ms;
+	telemetry.floors_generated++;
+}
+
+// A floor's tiles and ores all live in one block of memory, which is reused
+// for every floor and only grows(doubling) when a floor doesn't fit, so
+// going between floors doesn't touch the heap.
 
+typedef struct
+{
+	char *block;
+	size_t used, capacity;
+} Arena;
+
+Arena floor_arena = {0};
+
+void arena_reserve(Arena *a, size_t size) // empties the arena, making room for at least size bytes
+{
+	if(size > a->capacity)
+	{
+		size_t capacity = a->capacity ? a->capacity : 4096;
+		while(capacity < size) capacity *= 2;
+		free(a->block);
+		a->block = malloc(capacity);
+		a->capacity = capacity;
+	}
+	a->used = 0;
+}
+
+void *arena_alloc(Arena *a, size_t size)
+{
+	size = (size + 15) & ~(size_t)15; // keep everything 16 byte aligned
+	assert(a->used + size <= a->capacity); // can't grow, that would move what's already handed out
+	void *p = a->block + a->used;
+	a->used += size;
+	return p;
+}
+
+void allocate_floor(int wid, int hei) // an empty floor
+{
+	size_t column_size = 2*((sizeof(int)*hei + 15) & ~(size_t)15) + ((sizeof(Ore)*hei + 15) & ~(size_t)15)
+		+ ((sizeof(short)*hei + 15) & ~(size_t)15);
+	arena_reserve(&floor_arena, 4*((sizeof(void*)*wid + 15) & ~(size_t)15) + column_size*wid);
+
+	object_tiles.wid = wid;
+	object_tiles.hei = hei;
+	object_tiles.tiles = arena_alloc(&floor_arena, sizeof(int*)*object_tiles.wid);
 	for(int x = 0; x < object_tiles.wid; x++)
 	{
+		object_tiles.tiles[x] = arena_alloc(&floor_arena, sizeof(int)*object_tiles.hei);
 		for(int y = 0; y < object_tiles.hei; y++)
-			object_tiles.tiles[x][y] = rand()%100?EMPTY:ORE;
+			object_tiles.tiles[x][y] = EMPTY;
 	}
+
+	ore_map = arena_alloc(&floor_arena, sizeof(Ore*)*object_tiles.wid);
+	for(int x = 0; x < object_tiles.wid; x++)
+		ore_map[x] = arena_alloc(&floor_arena, sizeof(Ore)*object_tiles.hei);
+
+	miner_slot = arena_alloc(&floor_arena, sizeof(int*)*object_tiles.wid);
 	for(int x = 0; x < object_tiles.wid; x++)
 	{
-		for(int y = 0; y < object_tiles.hei; y++)
-		{
-			ore_map[x][y].type = weighed_rand(ore_frequencies, N_ORES);
-			ore_map[x][y].amount = ores[ore_map[x][y].type].amount;
-			ore_map[x][y].wear = ores[ore_map[x][y].type].durability;
-			ore_map[x][y].regen = 0; // normal ores don't regenerate(for now)
-		}
+		miner_slot[x] = arena_alloc(&floor_arena, sizeof(int)*object_tiles.hei);
+		memset(miner_slot[x], 0, sizeof(int)*object_tiles.hei);
 	}
-	int next_tier_chance = 0;
-	// measured in promils(1/1000) instead of percents for greater precision
 
-	if(mine_floor > 10)
+	journal_slot = arena_alloc(&floor_arena, sizeof(short*)*object_tiles.wid);
+	for(int x = 0; x < object_tiles.wid; x++)
 	{
-		next_tier_chance = (mine_floor-10)*10;
+		journal_slot[x] = arena_alloc(&floor_arena, sizeof(short)*object_tiles.hei);
+		memset(journal_slot[x], 0, sizeof(short)*object_tiles.hei);
 	}
+}
 
-	for(int i = 0; i < 5; i++)
-		if(rand()%1000 < next_tier_chance)
-			place_random_entrance();
-		else
-			place_random_stairs();
+// The mine path grows one floor at a time, so it gets room to spare
+int path_capacity = 0;
 
-	place_random_upstairs();
+void reserve_path(int n)
+{
+	if(n <= path_capacity) return;
+	while(path_capacity < n)
+		path_capacity = path_capacity ? path_capacity*2 : 16;
+	path = realloc(path, sizeof(MPath)*path_capacity);
+}
+
+// Checkpoint paths come from a pool of blocks sized in powers of two; freed
+// ones go on a list for their size and get handed out again, instead of
+// going back to the heap
+#define PATH_POOL_CLASSES 32
+typedef struct PathBlock { struct PathBlock *next; } PathBlock;
+PathBlock *path_pool[PATH_POOL_CLASSES] = {0};
+_Static_assert(sizeof(int2) >= sizeof(PathBlock), "a free path block keeps its list link in its first int2");
+
+int path_size_class(int depth)
+{
+	int c = 0;
+	while((1 << c) < depth) c++;
+	return c;
+}
+
+int2 *get_path_block(int depth)
+{
+	if(depth <= 0) return NULL;
+	int c = path_size_class(depth);
+	if(path_pool[c] == NULL)
+		return malloc(sizeof(int2) << c); // an int2 is big enough to hold the list link
+	PathBlock *b = path_pool[c];
+	path_pool[c] = b->next;
+	return (int2*)b;
+}
+
+void put_path_block(int2 *p, int depth)
+{
+	if(p == NULL) return;
+	PathBlock *b = (PathBlock*)p;
+	int c = path_size_class(depth);
+	b->next = path_pool[c];
+	path_pool[c] = b;
+}
+
+int checkpoints_capacity = 0;
+
+void reserve_checkpoints(int n)
+{
+	if(n <= checkpoints_capacity) return;
+	while(checkpoints_capacity < n)
+		checkpoints_capacity = checkpoints_capacity ? checkpoints_capacity*2 : 8;
+	checkpoints = realloc(checkpoints, sizeof(*checkpoints)*checkpoints_capacity);
 }
 
 void save_checkpoints(FILE *f)
@@ -476,32 +1048,26 @@ void save_checkpoints(FILE *f)
 
 void load_checkpoints(FILE *f)
 {
+	for(int i = 0; i < ncheckpoints; i++)
+		put_path_block(checkpoints[i].path, checkpoints[i].depth);
+
 	fread(&ncheckpoints, sizeof(ncheckpoints), 1, f);
-
-	if(checkpoints != NULL)
-	{
-		free(checkpoints);
-		checkpoints = NULL;
-	}
-	checkpoints = malloc(sizeof(*checkpoints)*ncheckpoints);
+	reserve_checkpoints(ncheckpoints);
 
 	for(int i = 0; i < ncheckpoints; i++)
 	{
 		fread(&checkpoints[i].depth, sizeof(checkpoints[i].depth), 1, f);
 		if(checkpoints[i].depth > 0)
 		{
-			checkpoints[i].path = malloc(sizeof(checkpoints[i].path)*checkpoints[i].depth);
+			checkpoints[i].path = get_path_block(checkpoints[i].depth);
 			fread(checkpoints[i].path, sizeof(checkpoints[i].path), checkpoints[i].depth, f);
 		}
 		else checkpoints[i].path = NULL;
 	}
 }
 
-char save_player_data()
+void write_player_data(FILE *f) // coins, upgrade levels and checkpoints
 {
-	FILE *f = fopen("player.dat", "wb");
-	if(!f) return 0;
-
 	fwrite(&coins, sizeof(coins), 1, f);
 
 	fwrite(&mining_speed, sizeof(mining_speed), 1, f);
@@ -509,15 +1075,10 @@ char save_player_data()
 	fwrite(&mining_skill, sizeof(mining_skill), 1, f);
 
 	save_checkpoints(f);
-	fclose(f);
-	return 1;
 }
 
-char load_player_data()
+void read_player_data(FILE *f)
 {
-	FILE *f = fopen("player.dat", "rb");
-	if(!f) return 0;
-
 	fread(&coins, sizeof(coins), 1, f);
 
 	fread(&mining_speed, sizeof(mining_speed), 1, f);
@@ -525,18 +1086,85 @@ char load_player_data()
 	fread(&mining_skill, sizeof(mining_skill), 1, f);
 
 	load_checkpoints(f);
-	fclose(f);
 
-	mining_delay = 1.0 / (1.0+mining_speed*0.05); //+5% to the boost of speed per upgrade
-	mining_damage = 2.0 * (1.0 + mining_power*0.05);
-	ore_value_multiplier = 1.0 + mining_skill*0.05;
+	mining_delay = speed_to_delay(mining_speed);
+	mining_damage = power_to_damage(mining_power);
+	ore_value_multiplier = skill_to_multiplier(mining_skill);
 	total_level = mining_speed + mining_power + mining_skill;
+}
+
+char player_file[4096] = "player.dat"; // made absolute at startup, the journal saves it from any floor
+char sync_saves = 0; // fsync every save right away; only recovery needs to, see the journal
+
+void sync_file(FILE *f)
+{
+	fflush(f);
+	fsync(fileno(f));
+}
+
+void sync_dir(const char *name) // makes a rename in the directory holding name stick
+{
+	char dir[4096];
+	snprintf(dir, sizeof(dir), "%s", name);
+	char *slash = strrchr(dir, '/');
+	if(slash == NULL) strcpy(dir, ".");
+	else if(slash == dir) slash[1] = '\0';
+	else *slash = '\0';
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if(fd < 0) return;
+	fsync(fd);
+	close(fd);
+}
+
+// Saves go to a temporary file that then replaces the old one, so a save cut
+// short by a crash leaves the previous one instead of half a file.
+char save_tmp[4104];
+
+FILE *begin_save(const char *name)
+{
+	snprintf(save_tmp, sizeof(save_tmp), "%s.tmp", name);
+	return fopen(save_tmp, "wb");
+}
+
+void journal_saved(const char *name);
+// forward declaration, the journal makes sure every save reaches the disk
+
+char end_save(FILE *f, const char *name)
+{
+	char ok = !ferror(f);
+	if(ok && sync_saves) sync_file(f);
+	if(fclose(f) != 0) ok = 0;
+	if(ok && rename(save_tmp, name) != 0) ok = 0;
+	if(!ok)
+	{
+		unlink(save_tmp);
+		return 0;
+	}
+	if(sync_saves) sync_dir(name);
+	journal_saved(name);
+	return 1;
+}
+
+char save_player_data()
+{
+	FILE *f = begin_save(player_file);
+	if(!f) return 0;
+	write_player_data(f);
+	return end_save(f, player_file);
+}
+
+char load_player_data()
+{
+	FILE *f = fopen(player_file, "rb");
+	if(!f) return 0;
+	read_player_data(f);
+	fclose(f);
 	return 1;
 }
 
 char save_floor()
 {
-	FILE *f = fopen("floor.dat", "wb");
+	FILE *f = begin_save("floor.dat");
 	if(!f)
 		return 0; // failure
 
@@ -560,8 +1188,8 @@ char save_floor()
 		}
 		else fputc(object_tiles.tiles[x][y], f);
 	}
-	fclose(f);
-	return 1; // success
+	telemetry.floor_bytes_written += ftell(f);
+	return end_save(f, "floor.dat");
 }
 
 char load_floor()
@@ -570,17 +1198,17 @@ char load_floor()
 	if(!f)
 		return 0;
 
-	for(int x = 0; x < object_tiles.wid; x++)
-		free(object_tiles.tiles[x]);
-	free(object_tiles.tiles);
-
-	object_tiles.wid = getc(f);
-	object_tiles.hei = getc(f);
+	int wid = getc(f);
+	int hei = getc(f);
+	if(wid <= 0 || hei <= 0) // empty or broken
+	{
+		fclose(f);
+		return 0;
+	}
+	allocate_floor(wid, hei); // reuses the same memory
 
-	object_tiles.tiles = malloc(sizeof(int*)*object_tiles.wid);
 	for(int x = 0; x < object_tiles.wid; x++)
 	{
-		object_tiles.tiles[x] = malloc(sizeof(int)*object_tiles.hei);
 		for(int y = 0; y < object_tiles.hei; y++)
 		{
 			int ch = getc(f);
@@ -596,18 +1224,24 @@ char load_floor()
 				object_tiles.tiles[x][y] = ch;
 		}
 	}
+	telemetry.floor_bytes_read += ftell(f);
 	fclose(f);
+	return 1;
 }
 
 void AddCheckpoint();
-// forward declaration, so that descend_floor() knows AddCheckpoint() exists
+void clear_miners();
+void floor_loaded();
+// forward declarations, so that descend_floor() knows these exist
 
 void descend_floor(int x, int y)
 {
 	char stairs = object_tiles.tiles[x][y]==STAIRS;
+	clear_miners();
+	telemetry.floor_transitions++;
 
 	depth++;
-	path = realloc(path, sizeof(MPath)*depth);
+	reserve_path(depth);
 	path[depth-1].x = x;
 	path[depth-1].y = y;
 	path[depth-1].z = mine_floor;
@@ -649,8 +1283,9 @@ void descend_floor(int x, int y)
 
 	player.x = upstairs.x*SCALE;
 	player.y = (upstairs.y-1)*SCALE;
-	object_tiles.tiles[upstairs.x][upstairs.y-1] = EMPTY;
+	object_tiles.tiles[upstairs.x][upstairs.y-1] = EMPTY; // floor_loaded() starts everyone over anyway
 	save_floor();
+	floor_loaded();
 
 	if(!stairs) // if this is a new mine
 		AddCheckpoint();
@@ -659,6 +1294,7 @@ void descend_floor(int x, int y)
 void ascend_floor()
 {
 	if(depth <= 0) return;
+	telemetry.floor_transitions++;
 
 	char stairs = path[depth-1].stairs;
 	int floor = path[depth-1].z;
@@ -666,7 +1302,6 @@ void ascend_floor()
 	int y = path[depth-1].y;
 
 	depth--;
-	path = realloc(path, sizeof(MPath)*depth);
 	if(stairs)
 		mine_floor--;
 	else
@@ -675,6 +1310,7 @@ void ascend_floor()
 		tier--;
 	}
 
+	clear_miners();
 	save_floor(); // save current floor
 	chdir(".."); // go to above directory
 	load_floor(); // load the above floor
@@ -683,6 +1319,8 @@ void ascend_floor()
 	player.y = (y+1)*SCALE;
 
 	// place player exactly below above entrance when ascending a floor
+
+	floor_loaded();
 }
 
 void DrawWearBar(float wear, int max_durability)
@@ -693,12 +1331,27 @@ void DrawWearBar(float wear, int max_durability)
 
 void DisplayUpgradeCosts()
 {
-	Color c = (coins >= mining_speed_upgrade)? WHITE : RED;
-	DrawText(TextFormat("F to upgrade mining speed from %d HPS for %d coins", mining_speed, mining_speed_upgrade), 0, COIN_WIDGET_SCALE*2, 20, c);
-	c = (coins >= mining_power_upgrade)? WHITE : RED;
-	DrawText(TextFormat("P to upgrade mining power from %d for %d coins", mining_power, mining_power_upgrade), 0, COIN_WIDGET_SCALE*2+20, 20, c);
-	c = (coins >= mining_skill_upgrade)? WHITE : RED;
-	DrawText(TextFormat("X to upgrade mining skill from %d for %d coins", mining_skill, mining_skill_upgrade), 0, COIN_WIDGET_SCALE*2+40, 20, c);
+	long long key[] = {mining_speed, mining_power, mining_skill,
+		mining_speed_upgrade, mining_power_upgrade, mining_skill_upgrade,
+		(coins >= mining_speed_upgrade) | (coins >= mining_power_upgrade)<<1 | (coins >= mining_skill_upgrade)<<2};
+	if(BeginHudWidget(&hud[HUD_UPGRADES], key, 7, WID, 60))
+	{
+		Color c = (coins >= mining_speed_upgrade)? WHITE : RED;
+		DrawText(TextFormat("F to upgrade mining speed from %d HPS for %d coins", mining_speed, mining_speed_upgrade), 0, 0, 20, c);
+		c = (coins >= mining_power_upgrade)? WHITE : RED;
+		DrawText(TextFormat("P to upgrade mining power from %d for %d coins", mining_power, mining_power_upgrade), 0, 20, 20, c);
+		c = (coins >= mining_skill_upgrade)? WHITE : RED;
+		DrawText(TextFormat("X to upgrade mining skill from %d for %d coins", mining_skill, mining_skill_upgrade), 0, 40, 20, c);
+		EndHudWidget();
+	}
+	DrawHudWidget(&hud[HUD_UPGRADES], 0, COIN_WIDGET_SCALE*2);
+}
+
+void update_upgrade_costs() // whenever a level changes
+{
+	mining_speed_upgrade = upgrade_cost(mining_speed, total_level);
+	mining_power_upgrade = upgrade_cost(mining_power, total_level);
+	mining_skill_upgrade = upgrade_cost(mining_skill, total_level);
 }
 
 void UpgradeMiningSpeed()
@@ -707,7 +1360,8 @@ void UpgradeMiningSpeed()
 	coins -= mining_speed_upgrade;
 
 	total_level++;
-	mining_speed++; mining_delay = 1.0 / (1.0+mining_speed*0.05); //+5% to the boost of speed per upgrade
+	mining_speed++; mining_delay = speed_to_delay(mining_speed);
+	update_upgrade_costs();
 }
 
 void UpgradeMiningPower()
@@ -716,7 +1370,8 @@ void UpgradeMiningPower()
 	coins -= mining_power_upgrade;
 
 	total_level++;
-	mining_power++; mining_damage = 2.0 * (1.0 + mining_power * 0.05);
+	mining_power++; mining_damage = power_to_damage(mining_power);
+	update_upgrade_costs();
 }
 
 void UpgradeMiningSkill()
@@ -725,301 +1380,3270 @@ void UpgradeMiningSkill()
 	coins -= mining_skill_upgrade;
 
 	total_level++;
-	mining_skill++; ore_value_multiplier = 1.0 + mining_skill * 0.05;
+	mining_skill++; ore_value_multiplier = skill_to_multiplier(mining_skill);
+	update_upgrade_costs();
 }
 
-void DrawCompass(int object_type, Color col) // for now, to make testing easier
+// Distance fields for getting around: for every tile, how many steps it is
+// to the nearest target of each kind, going around walls. They're built once
+// when a floor is loaded and patched up when tiles change, so following one is
+// a lookup per frame.
+
+enum NAV_TARGETS {NAV_STAIRS, NAV_UPSTAIRS, NAV_ENTRANCE, NAV_ORE, N_NAV_TARGETS};
+
+typedef struct
 {
-	Vector2 player_pos = (Vector2){player.x+player.width/2, player.y+player.height/2};
-	Vector2 object_pos = (Vector2){0, 0}, closest = (Vector2){0, 0};
-	float min_dst = -1;
-	for(int x = 0; x < object_tiles.wid; x++)
-	for(int y = 0; y < object_tiles.wid; y++)
+	int *dist; // steps to the nearest target, -1 if it can't be reached
+	int2 *targets; int ntargets; // as of the last build; adding or removing one makes it dirty
+	char dirty; // needs rebuilding before it's used again
+} DistanceField;
+
+DistanceField nav_fields[N_NAV_TARGETS] = {0};
+int nav_wid = 0, nav_hei = 0; // what the fields are allocated for
+int *nav_queue = NULL;
+int nav_ore_type = -1; // which ore NAV_ORE leads to
+int nav_target = -1; // which field auto-walk follows, -1 when it's off
+TileCursor nav_cursor = {0};
+
+#define NAV_AT(f, x, y) nav_fields[f].dist[(x)*nav_hei + (y)]
+
+char is_walkable(int x, int y) // same tiles collide_with_walls() lets through
+{
+	int t = object_tiles.tiles[x][y];
+	return t == EMPTY || t == STAIRS || t == UPSTAIRS || t == ENTRANCE;
+}
+
+char is_nav_target(int f, int x, int y)
+{
+	switch(f)
+	{
+		case NAV_STAIRS: return object_tiles.tiles[x][y] == STAIRS;
+		case NAV_UPSTAIRS: return object_tiles.tiles[x][y] == UPSTAIRS;
+		case NAV_ENTRANCE: return object_tiles.tiles[x][y] == ENTRANCE;
+		case NAV_ORE: return object_tiles.tiles[x][y] == ORE && ore_map[x][y].type == nav_ore_type;
+	}
+	return 0;
+}
+
+void spread_distance(int f, int head, int tail)
+// breadth-first from whatever is in the queue, only ever lowering distances
+{
+	int dx[4] = {1, -1, 0, 0}, dy[4] = {0, 0, 1, -1};
+	while(head < tail)
 	{
-		if(object_tiles.tiles[x][y] == object_type)
+		int x = nav_queue[head]/nav_hei, y = nav_queue[head]%nav_hei;
+		head++;
+		for(int i = 0; i < 4; i++)
 		{
-			object_pos = (Vector2){x*SCALE, y*SCALE};
-			float dst = Vector2Distance(player_pos, object_pos);
-			if(min_dst == -1 || dst < min_dst)
-			{
-				min_dst = dst;
-				closest = object_pos;
-			}
+			int nx = x+dx[i], ny = y+dy[i];
+			if(nx < 0 || nx >= nav_wid || ny < 0 || ny >= nav_hei) continue;
+			if(!is_walkable(nx, ny)) continue;
+			int *d = &NAV_AT(f, nx, ny);
+			if(*d != -1 && *d <= NAV_AT(f, x, y)+1) continue;
+			*d = NAV_AT(f, x, y)+1;
+			nav_queue[tail++] = nx*nav_hei + ny;
 		}
 	}
-
-	Vector2 compass_arrow = Vector2Scale(Vector2Normalize(Vector2Subtract(closest, player_pos)), 20);
-	DrawLineV(player_pos, Vector2Add(player_pos, compass_arrow), col);
 }
 
-void RegenerateOres(float dt) // only relevant to seal stones(for now)
+void build_distance_field(int f)
 {
-	for(int x = 0; x < object_tiles.wid; x++)
-	for(int y = 0; y < object_tiles.hei; y++)
+	int tail = 0;
+	nav_fields[f].ntargets = 0;
+	for(int x = 0; x < nav_wid; x++)
+	for(int y = 0; y < nav_hei; y++)
 	{
-		if(object_tiles.tiles[x][y] == ORE)
+		if(is_nav_target(f, x, y))
 		{
-			if(ore_map[x][y].wear < ores[ore_map[x][y].type].durability)
-			{
-				ore_map[x][y].wear += dt*ore_map[x][y].regen;
-				if(ore_map[x][y].wear > ores[ore_map[x][y].type].durability)
-					ore_map[x][y].wear = ores[ore_map[x][y].type].durability;
-			}
+			NAV_AT(f, x, y) = 0;
+			nav_queue[tail++] = x*nav_hei + y;
+			nav_fields[f].targets[nav_fields[f].ntargets++] = (int2){x, y};
 		}
+		else NAV_AT(f, x, y) = -1;
 	}
+	spread_distance(f, 0, tail);
+	nav_fields[f].dirty = 0;
 }
 
-void AddCheckpoint() // add current place as a checkpoint
+void build_distance_fields()
 {
-	// check if the same checkpoint has already been added:
-	for(int i = 0; i < ncheckpoints; i++)
+	if(nav_wid != object_tiles.wid || nav_hei != object_tiles.hei)
 	{
-		if(checkpoints[i].depth != depth) continue;
+		nav_wid = object_tiles.wid;
+		nav_hei = object_tiles.hei;
+		for(int f = 0; f < N_NAV_TARGETS; f++)
+		{
+			nav_fields[f].dist = realloc(nav_fields[f].dist, sizeof(int)*nav_wid*nav_hei);
+			nav_fields[f].targets = realloc(nav_fields[f].targets, sizeof(int2)*nav_wid*nav_hei);
+		}
+		nav_queue = realloc(nav_queue, sizeof(int)*nav_wid*nav_hei);
+	}
+	for(int f = 0; f < N_NAV_TARGETS; f++)
+		build_distance_field(f);
+	skip_tile_events(&nav_cursor);
+}
 
-		int j;
-		for(j = 0; j < depth; j++)
-			if(checkpoints[i].path[j].x != path[j].x || checkpoints[i].path[j].y != path[j].y)
-				break;
+void nav_tile_changed(int x, int y);
 
-		if(j == depth) // duplicate checkpoint found
-			return;
+void update_distance_fields() // catch up on tile changes
+{
+	if(tile_events_lost(&nav_cursor))
+	{
+		for(int f = 0; f < N_NAV_TARGETS; f++)
+			nav_fields[f].dirty = 1;
+		skip_tile_events(&nav_cursor);
+		return;
 	}
-
-	Checkpoint chkp;
-	chkp.depth = depth;
-	if(depth > 0)
+	for(TileEvent *e; (e = next_tile_event(&nav_cursor)) != NULL; )
 	{
-		chkp.path = malloc(sizeof(*chkp.path)*depth);
-		for(int i = 0; i < depth; i++)
-			chkp.path[i] = (int2){path[i].x, path[i].y};
+		if(e->tile == e->old_tile && e->type == e->old_type) continue; // just wear
+		char was_walkable = e->old_tile == EMPTY || e->old_tile == STAIRS || e->old_tile == UPSTAIRS || e->old_tile == ENTRANCE;
+		if(was_walkable && !is_walkable(e->x, e->y))
+		{ // a new wall can only make things further, which can't be patched up
+			for(int f = 0; f < N_NAV_TARGETS; f++)
+				nav_fields[f].dirty = 1;
+		}
+		else nav_tile_changed(e->x, e->y);
 	}
-	else chkp.path = NULL;
-
-	chkp.name = NULL; // this will come in later
-
-	checkpoints = realloc(checkpoints, ++ncheckpoints*sizeof(*checkpoints));
-	checkpoints[ncheckpoints-1] = chkp;
 }
 
-void GoToCheckpoint(int i)
+DistanceField *get_distance_field(int f)
 {
-	save_floor(); // save current floor
-
-	while(depth-- > 0)
-		chdir("..");
-	depth = 0;
-	free(path); path = NULL;
-	tier = 0;
-	mine_floor = 1;
-
-	load_floor(); // load surface floor
+	update_distance_fields();
+	if(nav_fields[f].dirty)
+		build_distance_field(f);
+	return &nav_fields[f];
+}
 
-	for(int j = 0; j < checkpoints[i].depth; j++)
-		descend_floor(checkpoints[i].path[j].x, checkpoints[i].path[j].y);
+void nav_tile_changed(int x, int y)
+{
+	if(nav_wid != object_tiles.wid || nav_hei != object_tiles.hei) return; // nothing built yet
 
-	ascend_floor();
-	// let the player end up at the entrance again
+	if(is_walkable(x, y))
+	{
+		// a new way through(a broken seal) can only make things closer,
+		// so just spread out from there
+		for(int f = 0; f < N_NAV_TARGETS; f++)
+		{
+			if(nav_fields[f].dirty) continue;
+			if((NAV_AT(f, x, y) == 0) != is_nav_target(f, x, y))
+			{
+				nav_fields[f].dirty = 1; // a target came or went, that has to be redone
+				continue;
+			}
+			int best = -1;
+			int dx[4] = {1, -1, 0, 0}, dy[4] = {0, 0, 1, -1};
+			for(int i = 0; i < 4; i++)
+			{
+				int nx = x+dx[i], ny = y+dy[i];
+				if(nx < 0 || nx >= nav_wid || ny < 0 || ny >= nav_hei) continue;
+				int d = NAV_AT(f, nx, ny);
+				if(d != -1 && (best == -1 || d+1 < best)) best = d+1;
+			}
+			if(best == -1) continue;
+			if(NAV_AT(f, x, y) != -1 && NAV_AT(f, x, y) <= best) continue;
+			NAV_AT(f, x, y) = best;
+			nav_queue[0] = x*nav_hei + y;
+			spread_distance(f, 0, 1);
+		}
+	}
+	else // an ore changed type, which only matters for the ore field
+		nav_fields[NAV_ORE].dirty = 1;
 }
 
-void RemoveCheckpoint(int i)
+void select_nav_ore(int type)
 {
-	free(checkpoints[i].path);
-	if(checkpoints[i].name != NULL) free(checkpoints[i].name);
+	if(type == nav_ore_type) return;
+	nav_ore_type = type;
+	nav_fields[NAV_ORE].dirty = 1;
+}
 
-	for(int j = i; j < ncheckpoints-1; j++)
-		checkpoints[j] = checkpoints[j+1];
+char nav_next_tile(int f, int2 *next)
+// the neighbouring tile that's one step closer to the target, 0 when
+// there's nowhere to go(already there, or it can't be reached)
+{
+	DistanceField *field = get_distance_field(f);
+	int x = (player.x+player.width/2)/SCALE, y = (player.y+player.height/2)/SCALE;
+	int d = field->dist[x*nav_hei + y];
+	if(d <= 0) return 0;
 
-	checkpoints = realloc(checkpoints, --ncheckpoints*sizeof(*checkpoints));
+	int dx[4] = {1, -1, 0, 0}, dy[4] = {0, 0, 1, -1};
+	for(int i = 0; i < 4; i++)
+	{
+		int nx = x+dx[i], ny = y+dy[i];
+		if(nx < 0 || nx >= nav_wid || ny < 0 || ny >= nav_hei) continue;
+		if(field->dist[nx*nav_hei + ny] == d-1)
+		{
+			if(!is_walkable(nx, ny)) return 0; // right next to the ore
+			*next = (int2){nx, ny};
+			return 1;
+		}
+	}
+	return 0;
 }
 
-int main()
+void auto_walk(float dt)
+// walks to the centre of the next tile, lining up with the current one
+// first so that the player fits through one tile wide gaps
 {
-	char *ore_name; int prev_amount;
-	// both vars are for displaying the "Ore x amount" message at the bottom
-	// when mining
+	int2 next;
+	if(!nav_next_tile(nav_target, &next))
+	{
+		nav_target = -1;
+		return;
+	}
 
-	FILE *seedfile;
+	float step = dt*PLAYER_SPEED*SCALE/50;
+	Vector2 pos = (Vector2){player.x+player.width/2, player.y+player.height/2};
+	int x = pos.x/SCALE, y = pos.y/SCALE;
+	Vector2 here = (Vector2){(x+0.5)*SCALE, (y+0.5)*SCALE};
+	Vector2 there = (Vector2){(next.x+0.5)*SCALE, (next.y+0.5)*SCALE};
 
-	seedfile = fopen("seed.txt", "r");
-	if(seedfile != NULL) // if file exists
+	if(next.x != x) // going sideways
 	{
-		fscanf(seedfile, "%d", &worldseed);
-		printf("World seed set to %d.\n", worldseed);
-		fclose(seedfile);
+		if(fabsf(here.y - pos.y) > 0.5)
+			player.y += Clamp(here.y - pos.y, -step, step);
+		else
+			player.x += Clamp(there.x - pos.x, -step, step);
+	}
+	else
+	{
+		if(fabsf(here.x - pos.x) > 0.5)
+			player.x += Clamp(here.x - pos.x, -step, step);
+		else
+			player.y += Clamp(there.y - pos.y, -step, step);
 	}
+}
 
-	InitWindow(WID, HEI, "Silver Mountain");
-	SetTargetFPS(60);
+// Minimap: one texel per tile, uploaded whole when a floor loads and one
+// texel at a time when a tile changes, so it's one quad to draw at any map size
 
-	object_tiles.wid = object_tiles.hei = 100;
-	object_tiles.tiles = malloc(sizeof(int*)*object_tiles.wid);
-	for(int x = 0; x < object_tiles.wid; x++)
+Texture2D minimap = {0};
+Color *minimap_pixels = NULL;
+TileCursor minimap_cursor = {0};
+#define MINIMAP_SIZE 150 // pixels on screen, along the longer side
+
+Color minimap_color(int x, int y)
+{
+	switch(object_tiles.tiles[x][y])
 	{
-		object_tiles.tiles[x] = malloc(sizeof(int)*object_tiles.hei);
-		for(int y = 0; y < object_tiles.hei; y++)
-			object_tiles.tiles[x][y] = EMPTY;
+		case WALL: return GRAY;
+		case STAIRS: return BLACK;
+		case UPSTAIRS: return SKYBLUE;
+		case ENTRANCE: return DARKBROWN;
+		case ORE: return ores[ore_map[x][y].type].fg;
 	}
+	return tier_colors[tier];
+}
 
-	ore_map = malloc(sizeof(Ore*)*object_tiles.wid);
-	for(int x = 0; x < object_tiles.wid; x++)
-		ore_map[x] = malloc(sizeof(Ore)*object_tiles.hei);
+void build_minimap()
+{
+	int wid = object_tiles.wid, hei = object_tiles.hei;
+	char resized = minimap.id == 0 || minimap.width != wid || minimap.height != hei;
+	if(resized)
+		minimap_pixels = realloc(minimap_pixels, sizeof(Color)*wid*hei);
 
-	generate_floor(); // Because the depth is 0, it will generate the surface "floor"
-	save_floor();
+	for(int x = 0; x < wid; x++)
+	for(int y = 0; y < hei; y++)
+		minimap_pixels[y*wid + x] = minimap_color(x, y);
 
-	camera.offset = (Vector2){WID/2, HEI/2};
-	camera.rotation = 0;
-	camera.zoom = 1.0;
+	if(resized)
+	{
+		if(minimap.id != 0) UnloadTexture(minimap);
+		minimap = LoadTextureFromImage((Image){minimap_pixels, wid, hei, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8});
+	}
+	else UpdateTexture(minimap, minimap_pixels);
+	skip_tile_events(&minimap_cursor);
+}
 
-	load_player_data();
-	// if there is no player data, leaves the default values
+#define MINIMAP_TEXEL_UPDATES 64 // past this many changed texels, sending the whole texture is cheaper
 
-	int which_checkpoint = 0;
-	// which checkpoint we're currently cycling through(the index)
+void update_minimap() // catch up on tile changes, once a frame before drawing
+{
+	if(minimap.id == 0 || tile_events_lost(&minimap_cursor))
+	{
+		build_minimap();
+		return;
+	}
 
-	while(!WindowShouldClose())
+	int wid = object_tiles.wid, changed = 0;
+	for(TileEvent *e; (e = next_tile_event(&minimap_cursor)) != NULL; )
 	{
-		BeginDrawing();
-		if(depth == 0)
-			ClearBackground(SKYBLUE);
-		else
-			ClearBackground(BLACK);
-		float dt = GetFrameTime();
+		if(e->tile == e->old_tile && e->type == e->old_type) continue; // just wear, same color
+		Color c = minimap_color(e->x, e->y);
+		Color *p = &minimap_pixels[e->y*wid + e->x];
+		if(p->r == c.r && p->g == c.g && p->b == c.b && p->a == c.a) continue;
+		*p = c;
+		if(++changed <= MINIMAP_TEXEL_UPDATES)
+			UpdateTextureRec(minimap, (Rectangle){e->x, e->y, 1, 1}, p);
+	}
+	if(changed > MINIMAP_TEXEL_UPDATES)
+		UpdateTexture(minimap, minimap_pixels);
+}
 
-		mining_speed_upgrade = 2 * mining_speed * mining_speed + total_level;
-		mining_power_upgrade = 2 * mining_power * mining_power + total_level;
-		mining_skill_upgrade = 2 * mining_skill * mining_skill + total_level;
+void DrawMinimap()
+{
+	if(minimap.id == 0) return;
+	float scale = (float)MINIMAP_SIZE / (minimap.width > minimap.height ? minimap.width : minimap.height);
+	Rectangle dest = {WID - minimap.width*scale - 10, 10, minimap.width*scale, minimap.height*scale};
+	DrawTexturePro(minimap, (Rectangle){0, 0, minimap.width, minimap.height}, dest, (Vector2){0, 0}, 0, WHITE);
+	DrawRectangle(dest.x + player.x/SCALE*scale, dest.y + player.y/SCALE*scale, 3, 3, RED);
+}
 
-		if(IsKeyPressed(KEY_F))
-			UpgradeMiningSpeed();
-		if(IsKeyPressed(KEY_P))
-			UpgradeMiningPower();
-		if(IsKeyPressed(KEY_X))
-			UpgradeMiningSkill();
+void DrawFloorOverview() // the lowest level of detail: the minimap stretched over the floor
+{
+	DrawTexturePro(minimap, (Rectangle){0, 0, minimap.width, minimap.height},
+		(Rectangle){0, 0, MAP_WID, MAP_HEI}, (Vector2){0, 0}, 0, WHITE);
+}
 
-		if(IsKeyPressed(KEY_C) && ncheckpoints > 0) // cycle checkpoints
-		{
-			which_checkpoint++;
-			which_checkpoint %= ncheckpoints;
-			GoToCheckpoint(which_checkpoint);
-			player_mode = MOVING;
-		}
-		if(IsKeyPressed(KEY_R) && ncheckpoints > 0) // remove checkpoint
-		{
-			RemoveCheckpoint(which_checkpoint);
-		}
+void toggle_auto_walk(int f)
+{
+	nav_target = nav_target == f ? -1 : f;
+}
 
-		Rectangle prev_player_pos = player;
-		if(IsKeyDown(KEY_W) || IsKeyDown(KEY_UP))
-			player.y -= dt*PLAYER_SPEED*SCALE/50;
-		if(IsKeyDown(KEY_A) || IsKeyDown(KEY_LEFT))
-			player.x -= dt*PLAYER_SPEED*SCALE/50;
-		if(IsKeyDown(KEY_S) || IsKeyDown(KEY_DOWN))
-			player.y += dt*PLAYER_SPEED*SCALE/50;
-		if(IsKeyDown(KEY_D) || IsKeyDown(KEY_RIGHT))
-			player.x += dt*PLAYER_SPEED*SCALE/50;
+int floors_loaded = 0; // how many times floor_loaded() ran
+char headless = 0; // no window, so nothing gets drawn or sent to the GPU
 
-		collide_with_walls(&player, prev_player_pos);
+void floor_loaded() // whenever a whole new floor got loaded or generated
+{
+	floors_loaded++;
+	floor_replaced();
+	build_distance_fields(); // right away, the minimap waits until it's drawn
+}
 
-		if(player.x < 0) player.x = 0;
-		if(player.y < 0) player.y = 0;
-		if(player.x+player.width > MAP_WID) player.x = MAP_WID-player.width;
-		if(player.y+player.height > MAP_HEI) player.y = MAP_HEI-player.height;
+void DrawCompass(Vector2 player_pos, int object_type, Color col) // for now, to make testing easier
+{
+	Vector2 object_pos = (Vector2){0, 0}, closest = (Vector2){0, 0};
 
-		camera.target = (Vector2){player.x+player.width/2, player.y+player.height/2};
+	int f = object_type == STAIRS ? NAV_STAIRS : object_type == UPSTAIRS ? NAV_UPSTAIRS : NAV_ENTRANCE;
+	int2 next;
+	if(nav_next_tile(f, &next)) // point the way around the walls
+	{
+		closest = (Vector2){(next.x+0.5)*SCALE, (next.y+0.5)*SCALE};
+		Vector2 compass_arrow = Vector2Scale(Vector2Normalize(Vector2Subtract(closest, player_pos)), 20);
+		DrawLineV(player_pos, Vector2Add(player_pos, compass_arrow), col);
+		return;
+	}
 
-		if(player.x != prev_player_pos.x || player.y != prev_player_pos.y)
-			player_mode = MOVING;
-		if(IsMouseButtonPressed(MOUSE_BUTTON_LEFT))
+	// can't be walked to, so just point at the closest one; the field
+	// already knows where they all are
+	DistanceField *field = get_distance_field(f);
+	if(field->ntargets == 0) return; // none on this floor(like upstairs on the surface)
+	float min_dst = -1;
+	for(int i = 0; i < field->ntargets; i++)
+	{
+		object_pos = (Vector2){field->targets[i].x*SCALE, field->targets[i].y*SCALE};
+		float dst = Vector2Distance(player_pos, object_pos);
+		if(min_dst == -1 || dst < min_dst)
 		{
-			Vector2 mpos = GetMousePosition();
-			mpos = Vector2Add(mpos, camera.target);
-			mpos = Vector2Subtract(mpos, camera.offset);
-			int tilex, tiley;
-			tilex = (int)(mpos.x/SCALE);
-			tiley = (int)(mpos.y/SCALE);
-
-			if(Vector2Distance(mpos, camera.target) <= 2*SCALE)
-			if(object_tiles.tiles[tilex][tiley] == ORE)
-			if(player_mode != MINING)
-			{
-				player_mode = MINING;
-				mining_target = (int2){tilex, tiley};
-				time_since_last_mined = mining_delay;
-				prev_amount = ore_map[tilex][tiley].amount;
-				ore_name = ores[ore_map[tilex][tiley].type].name;
-			}
+			min_dst = dst;
+			closest = object_pos;
 		}
+	}
 
-		if(player_mode == MOVING)
-			mining_target = (int2){-1, -1};
+	Vector2 compass_arrow = Vector2Scale(Vector2Normalize(Vector2Subtract(closest, player_pos)), 20);
+	DrawLineV(player_pos, Vector2Add(player_pos, compass_arrow), col);
+}
 
-		BeginMode2D(camera);
-		DrawRectangle(0, 0, MAP_WID, MAP_HEI, tier_colors[tier]);
-		DrawObjectTiles(mining_target, time_since_last_mined);
-		DrawRectangleRec(player, RED);
-		DrawCompass(STAIRS, GREEN);
-		DrawCompass(UPSTAIRS, BLUE);
-		EndMode2D();
+// The ores that regenerate(only seal stones, for now), so that regenerating
+// them doesn't scan the floor every step. Found once per floor, then kept up
+// from the tile events.
+int2 *regenerating = NULL;
+int nregenerating = 0, regenerating_capacity = 0;
+TileCursor regen_cursor = {0};
 
-		DisplayCoins();
-		DisplayUpgradeCosts();
+void add_regenerating(int x, int y)
+{
+	for(int i = 0; i < nregenerating; i++)
+		if(regenerating[i].x == x && regenerating[i].y == y)
+			return;
+	if(nregenerating == regenerating_capacity)
+	{
+		regenerating_capacity = regenerating_capacity ? regenerating_capacity*2 : 16;
+		regenerating = realloc(regenerating, sizeof(int2)*regenerating_capacity);
+	}
+	regenerating[nregenerating++] = (int2){x, y};
+}
 
-		ores[SEAL].durability = mining_damage*2;
-		RegenerateOres(dt);
-		if(player_mode == MINING)
-		{
-			int2 t = mining_target;
-			while(time_since_last_mined >= mining_delay)
-			{
-				time_since_last_mined -= mining_delay;
-				ore_map[t.x][t.y].wear -= mining_damage;
-				if(ore_map[t.x][t.y].wear <= 0)
-				{
-					ore_map[t.x][t.y].wear = ores[ore_map[t.x][t.y].type].durability;
-					ore_map[t.x][t.y].amount--;
-					prev_amount = ore_map[t.x][t.y].amount;
-					coins += ore_value_multiplier*ores[ore_map[t.x][t.y].type].value;
-					if(ore_map[t.x][t.y].amount <= 0)
-					{
-						if(ore_map[t.x][t.y].type == SEAL)
-							object_tiles.tiles[t.x][t.y] = EMPTY;
-						else
-						{
-							ore_map[t.x][t.y].type = tier_ores[tier-1][RUBBLE];
-							ore_map[t.x][t.y].amount = 10000;
-							ore_map[t.x][t.y].wear = ores[tier_ores[tier-1][RUBBLE]].durability;
-						}
-						player_mode = MOVING;
-						time_since_last_mined = 0;
-						break;
-					}
-				}
-			}
-			DrawText(TextFormat("%s x %d", ore_name, prev_amount), WID/3, HEI-20, 20, YELLOW);
-			DrawWearBar(ore_map[t.x][t.y].wear, ores[ore_map[t.x][t.y].type].durability);
-			time_since_last_mined += dt;
-		}
+void update_regenerating()
+{
+	if(tile_events_lost(&regen_cursor))
+	{
+		nregenerating = 0;
+		for(int x = 0; x < object_tiles.wid; x++)
+		for(int y = 0; y < object_tiles.hei; y++)
+			if(object_tiles.tiles[x][y] == ORE && ore_map[x][y].regen != 0)
+				add_regenerating(x, y);
+		skip_tile_events(&regen_cursor);
+		return;
+	}
+	for(TileEvent *e; (e = next_tile_event(&regen_cursor)) != NULL; )
+		if(e->tile == ORE && e->regen != 0 && (e->old_tile != ORE || e->old_type != e->type))
+			add_regenerating(e->x, e->y);
+}
 
-		int2 pos;
-		if(touches_stairs(player, &pos)) descend_floor(pos.x, pos.y);
-		else if(touches_entrance(player, &pos)) descend_floor(pos.x, pos.y);
-		else if(touches_upstairs(player)) // up
-			ascend_floor();
+#define REGEN_STEPS 6 // ores regenerate a batch of steps at a time, so a healing seal doesn't log a tile event every step
+float regen_time = 0; int regen_steps = 0;
 
-		DrawText(TextFormat("Floor: %d", mine_floor), 0, HEI-20, 20, WHITE);
+void RegenerateOres(float dt)
+{
+	regen_time += dt;
+	if(++regen_steps < REGEN_STEPS) return;
+	dt = regen_time;
+	regen_time = 0; regen_steps = 0;
 
-		EndDrawing();
+	update_regenerating();
+	for(int i = 0; i < nregenerating; )
+	{
+		int x = regenerating[i].x, y = regenerating[i].y;
+		if(object_tiles.tiles[x][y] != ORE || ore_map[x][y].regen == 0) // mined out
+		{
+			regenerating[i] = regenerating[--nregenerating];
+			continue;
+		}
+		if(ore_map[x][y].wear < ores[ore_map[x][y].type].durability)
+		{
+			float wear = ore_map[x][y].wear + dt*ore_map[x][y].regen;
+			if(wear > ores[ore_map[x][y].type].durability)
+				wear = ores[ore_map[x][y].type].durability;
+			set_ore_state(x, y, ore_map[x][y].amount, wear);
+		}
+		i++;
 	}
-	save_floor();
-	// make sure to save the floor when exiting the game,
-	// and not just when we're leaving it for another floor
+}
 
-	while(depth-- > 0) chdir("..");
-	// make sure we're at the top directory before we
-	// write the save file
+typedef struct
+{
+	long long hits; // how many times the pickaxe struck
+	int mined; // how many ore pieces got broken off
+	int coins; // how much those pieces were worth
+	int amount; // how many pieces are left
+	float wear; // wear of the top piece afterwards
+	float time_left; // time that didn't add up to a whole hit
+	char depleted; // whether the last piece got mined
+} MiningResult;
+
+int hits_to_break(float wear, float damage)
+// does the exact same float subtractions as hitting the ore one at a time,
+// so that the result always matches the step-by-step mining
+{
+	if(damage <= 0) return INT_MAX; // never breaks
+	int hits = 0;
+	do
+	{
+		wear -= damage;
+		hits++;
+	} while(wear > 0);
+	return hits;
+}
 
-	save_player_data();
+float wear_after_hits(float wear, float damage, long long hits)
+{
+	while(hits-- > 0)
+		wear -= damage;
+	return wear;
+}
+
+MiningResult mine_hits(long long hits, float damage, float wear, int durability, int amount, int value, float multiplier)
+// Works out what many hits in a row do to an ore without going through
+// them one by one. Only the top piece and the leftover hits on the last piece
+// are walked through; every piece in between starts at full durability, so
+// they all take the same number of hits. The cost therefore doesn't depend on
+// how many hits there are, only on durability/damage.
+{
+	MiningResult r = {0};
+	r.amount = amount;
+	r.wear = wear;
+	if(amount <= 0) // nothing left to mine
+	{
+		r.depleted = 1;
+		return r;
+	}
+	if(damage <= 0) // the hits don't do anything
+	{
+		r.hits = hits;
+		return r;
+	}
+
+	int first = hits_to_break(wear, damage);
+	if(hits < first) // the top piece holds
+	{
+		r.hits = hits;
+		r.wear = wear_after_hits(wear, damage, hits);
+		return r;
+	}
+
+	int per_piece = hits_to_break(durability, damage);
+	long long pieces = 1 + (hits-first)/per_piece;
+	if(pieces >= amount)
+	{
+		pieces = amount;
+		r.depleted = 1;
+	}
+
+	r.mined = pieces;
+	r.amount = amount - pieces;
+	r.coins = pieces * (int)(multiplier*value);
+	if(r.depleted)
+	{
+		r.hits = first + (pieces-1)*per_piece;
+		r.wear = durability;
+	}
+	else
+	{
+		r.hits = hits;
+		r.wear = wear_after_hits(durability, damage, hits - first - (pieces-1)*per_piece);
+	}
+	return r;
+}
+
+#define EXACT_HITS 256 // below this many hits, time is counted off exactly like the step loop did
+
+MiningResult fast_forward_mining(float elapsed, float delay, float damage, float wear, int durability, int amount, int value, float multiplier)
+// what mining an ore for the given time does. The cost doesn't grow with the
+// time: up to EXACT_HITS hits get counted off one by one, past that the hits
+// are divided out, and mine_hits() costs O(durability/damage). Used every
+// frame, and for catching up on long stretches, though it doesn't know about
+// seal regeneration: over a long stretch on a seal, that has to be applied
+// separately.
+{
+	long long hits = 0;
+	float left = elapsed;
+	if(elapsed < EXACT_HITS*delay)
+		while(left >= delay) // a frame's worth; bit for bit what the old loop did
+		{
+			left -= delay;
+			hits++;
+		}
+	else
+	{
+		// subtracting the delay over and over only piles up rounding
+		// errors for long stretches, so divide instead
+		hits = (long long)(elapsed/delay);
+		while(hits > 0 && elapsed - hits*(double)delay < 0) hits--;
+		while(elapsed - (hits+1)*(double)delay >= 0) hits++;
+		left = elapsed - hits*(double)delay;
+	}
+
+	MiningResult r = mine_hits(hits, damage, wear, durability, amount, value, multiplier);
+	r.time_left = r.depleted ? 0 : left;
+	return r;
+}
+
+void deplete_ore(int x, int y) // what's left of an ore once it's mined out
+{
+	if(ore_map[x][y].type == SEAL)
+		set_tile(x, y, EMPTY);
+	else
+	{
+		int rubble = tier_ores[tier-1][RUBBLE];
+		set_ore(x, y, rubble, category_amount[RUBBLE], ores[rubble].durability, ore_map[x][y].regen);
+	}
+}
+
+typedef struct
+{
+	int n, capacity;
+	int *x, *y; // target tile
+	float *wear; // target's wear, gathered from ore_map every tick
+	float *timer; // time since last hit, like time_since_last_mined for the player
+	float *delay, *damage;
+	int *hits; // how many hits each job landed this tick
+} MinerJobs; // every drill/helper mining on the current floor, structure-of-arrays
+MinerJobs miners = {0};
+
+char add_miner(int x, int y, float delay, float damage)
+{
+	if(object_tiles.tiles[x][y] != ORE) return 0;
+	if(ore_map[x][y].type == SEAL) return 0; // seals are for the player to break
+	if(miner_slot[x][y]) return 0; // one job per tile
+
+	if(miners.n == miners.capacity)
+	{
+		miners.capacity = miners.capacity ? miners.capacity*2 : 64;
+		miners.x = realloc(miners.x, sizeof(*miners.x)*miners.capacity);
+		miners.y = realloc(miners.y, sizeof(*miners.y)*miners.capacity);
+		miners.wear = realloc(miners.wear, sizeof(*miners.wear)*miners.capacity);
+		miners.timer = realloc(miners.timer, sizeof(*miners.timer)*miners.capacity);
+		miners.delay = realloc(miners.delay, sizeof(*miners.delay)*miners.capacity);
+		miners.damage = realloc(miners.damage, sizeof(*miners.damage)*miners.capacity);
+		miners.hits = realloc(miners.hits, sizeof(*miners.hits)*miners.capacity);
+	}
+
+	int i = miners.n++;
+	miners.x[i] = x;
+	miners.y[i] = y;
+	miners.wear[i] = ore_map[x][y].wear;
+	miners.timer[i] = 0;
+	miners.delay[i] = delay;
+	miners.damage[i] = damage;
+	miners.hits[i] = 0;
+	miner_slot[x][y] = i+1;
+	return 1;
+}
+
+void remove_miner(int i) // the last job takes its place
+{
+	miner_slot[miners.x[i]][miners.y[i]] = 0;
+	int last = --miners.n;
+	if(i != last)
+		miner_slot[miners.x[last]][miners.y[last]] = i+1;
+	miners.x[i] = miners.x[last];
+	miners.y[i] = miners.y[last];
+	miners.wear[i] = miners.wear[last];
+	miners.timer[i] = miners.timer[last];
+	miners.delay[i] = miners.delay[last];
+	miners.damage[i] = miners.damage[last];
+	miners.hits[i] = miners.hits[last];
+}
+
+void clear_miners() // jobs belong to the floor, so they stop when the player leaves it
+{
+	for(int i = 0; i < miners.n; i++)
+		miner_slot[miners.x[i]][miners.y[i]] = 0;
+	miners.n = 0;
+}
+
+void advance_miners(float dt)
+{
+	int n = miners.n;
+	float *restrict wear = miners.wear, *restrict timer = miners.timer;
+	float *restrict delay = miners.delay, *restrict damage = miners.damage;
+	int *restrict hits = miners.hits;
+
+	// the player and seal regeneration can touch the same ores, so ore_map
+	// stays the real thing and the jobs just take a copy each tick
+	for(int i = 0; i < n; i++)
+		wear[i] = ore_map[miners.x[i]][miners.y[i]].wear;
+
+	// the batch itself: no branches and no lookups, so it vectorizes
+	for(int i = 0; i < n; i++)
+	{
+		timer[i] += dt;
+		int h = timer[i]/delay[i];
+		timer[i] -= h*delay[i];
+		hits[i] = h;
+		wear[i] -= h*damage[i];
+	}
+
+	// write back the few jobs that hit something; a single hit that doesn't
+	// break a piece is the common case, everything else goes through mine_hits()
+	for(int i = 0; i < n; i++)
+	{
+		if(hits[i] == 0) continue;
+		Ore *o = &ore_map[miners.x[i]][miners.y[i]];
+		if(object_tiles.tiles[miners.x[i]][miners.y[i]] != ORE)
+		{
+			hits[i] = -1; // someone else mined it out already
+			continue;
+		}
+		if(hits[i] == 1 && wear[i] > 0)
+		{
+			set_ore_state(miners.x[i], miners.y[i], o->amount, wear[i]);
+			continue;
+		}
+
+		MiningResult r = mine_hits(hits[i], damage[i], o->wear, ores[o->type].durability, o->amount, ores[o->type].value, ore_value_multiplier);
+		set_ore_state(miners.x[i], miners.y[i], r.amount, r.wear);
+		coins += r.coins;
+		telemetry.ores_mined[o->type] += r.mined;
+		telemetry.coins_earned += r.coins;
+		if(r.depleted)
+			hits[i] = -2;
+	}
+
+	// depletions go last, so that removing jobs doesn't shuffle the batch
+	for(int i = 0; i < miners.n; )
+	{
+		if(hits[i] == -2)
+			deplete_ore(miners.x[i], miners.y[i]);
+		if(hits[i] < 0)
+			remove_miner(i);
+		else i++;
+	}
+}
+
+void DrawMiners()
+{
+	int x0, y0, x1, y1;
+	visible_tiles(&x0, &y0, &x1, &y1);
+	if((long long)(x1-x0)*(y1-y0) < miners.n) // fewer tiles on screen than jobs
+	{
+		for(int x = x0; x < x1; x++)
+		for(int y = y0; y < y1; y++)
+			if(miner_slot[x][y])
+				DrawRectangleLines(x*SCALE, y*SCALE, SCALE, SCALE, ORANGE);
+		return;
+	}
+	for(int i = 0; i < miners.n; i++)
+		if(miners.x[i] >= x0 && miners.x[i] < x1 && miners.y[i] >= y0 && miners.y[i] < y1)
+			DrawRectangleLines(miners.x[i]*SCALE, miners.y[i]*SCALE, SCALE, SCALE, ORANGE);
+}
+
+int run_miner_bench(int argc, char **argv) // --miner-bench [jobs] [ticks], times advance_miners() on a crowded floor
+{
+	int jobs = argc > 0 ? atoi(argv[0]) : 4000, ticks = argc > 1 ? atoi(argv[1]) : 3600;
+	if(jobs <= 0 || ticks <= 0) return 1;
+	float dt = 1.0/60; // a simulation step
+
+	// a generated floor, with its empty tiles filled up with the tier's ores
+	// until there's one for every job
+	int side = 16;
+	while(side < 255 && side*side < jobs*2) side *= 2;
+	if(side > 255) side = 255;
+	MPath entrance = {10, 10, 1, 0};
+	reserve_path(1);
+	path[0] = entrance;
+	depth = 1; tier = 1; mine_floor = 1;
+	allocate_floor(side, side);
+	generate_floor();
+	floor_replaced(); // filled up through set_ore() below, like ores change in play
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int targets = 0;
+	for(int x = 0; x < side; x++)
+	for(int y = 0; y < side; y++)
+	{
+		if(targets >= jobs) break;
+		if(object_tiles.tiles[x][y] == EMPTY)
+		{
+			int type = tier_ores[tier-1][MASS + (x+y)%3];
+			set_ore(x, y, type, ores[type].amount, ores[type].durability, 0);
+		}
+		if(object_tiles.tiles[x][y] == ORE && add_miner(x, y, mining_delay*(1+(x*7+y)%5*0.25), mining_damage))
+			targets++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double spawn = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+
+	long long job_ticks = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < ticks; i++)
+	{
+		job_ticks += miners.n;
+		advance_miners(dt);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+
+	unsigned long long h = 14695981039346656037ULL; // the state mining left behind, to compare builds with
+	h = (h ^ coins) * 1099511628211ULL;
+	for(int x = 0; x < side; x++)
+	for(int y = 0; y < side; y++)
+		h = (h ^ (object_tiles.tiles[x][y] == ORE ? ore_map[x][y].amount : -1)) * 1099511628211ULL;
+	printf("%d jobs on a %dx%d floor(spawned in %.2f ms), %d ticks: %.3f ms/tick, %.1f ns per job and tick, %d jobs left, %d coins, checksum %016llx\n",
+		targets, side, side, 1000*spawn, ticks, 1000*t/ticks, job_ticks ? 1e9*t/job_ticks : 0, miners.n, coins, h);
+	return 0;
+}
+
+void AddCheckpoint() // add current place as a checkpoint
+{
+	// check if the same checkpoint has already been added:
+	for(int i = 0; i < ncheckpoints; i++)
+	{
+		if(checkpoints[i].depth != depth) continue;
+
+		int j;
+		for(j = 0; j < depth; j++)
+			if(checkpoints[i].path[j].x != path[j].x || checkpoints[i].path[j].y != path[j].y)
+				break;
+
+		if(j == depth) // duplicate checkpoint found
+			return;
+	}
+
+	Checkpoint chkp;
+	chkp.depth = depth;
+	if(depth > 0)
+	{
+		chkp.path = get_path_block(depth);
+		for(int i = 0; i < depth; i++)
+			chkp.path[i] = (int2){path[i].x, path[i].y};
+	}
+	else chkp.path = NULL;
+
+	chkp.name = NULL; // this will come in later
+
+	reserve_checkpoints(++ncheckpoints);
+	checkpoints[ncheckpoints-1] = chkp;
+}
+
+void GoToCheckpoint(int i)
+{
+	save_floor(); // save current floor
+	clear_miners();
+
+	while(depth-- > 0)
+		chdir("..");
+	depth = 0;
+	// path keeps its memory for the way back down
+	tier = 0;
+	mine_floor = 1;
+
+	load_floor(); // load surface floor
+
+	for(int j = 0; j < checkpoints[i].depth; j++)
+		descend_floor(checkpoints[i].path[j].x, checkpoints[i].path[j].y);
+
+	ascend_floor();
+	// let the player end up at the entrance again
+}
+
+void RemoveCheckpoint(int i)
+{
+	put_path_block(checkpoints[i].path, checkpoints[i].depth);
+	if(checkpoints[i].name != NULL) free(checkpoints[i].name);
+
+	for(int j = i; j < ncheckpoints-1; j++)
+		checkpoints[j] = checkpoints[j+1];
+
+	ncheckpoints--;
+}
+
+// Headless economy simulator, for checking the balance without playing for
+// hours. Bots walk around a modeled floor, mine with the real mining code and
+// buy upgrades at the real prices, each following a strategy.
+
+enum UPGRADES {SPEED_UPGRADE, POWER_UPGRADE, SKILL_UPGRADE, N_UPGRADES};
+
+typedef struct
+{
+	int coins;
+	int level[N_UPGRADES];
+	int tier, floor;
+	double time; // seconds played
+	unsigned int rng;
+} Bot;
+
+typedef struct
+{
+	char *name;
+	char (*wants_ore)(Bot *b, int category); // whether to mine an ore it comes across
+	int (*next_upgrade)(Bot *b); // which upgrade to save up for
+	int ores_per_floor; // how many ores to mine before taking the stairs
+} BotStrategy;
+
+#define SIM_MAX_HOURS 48
+typedef struct
+{
+	long long hits; // pickaxe hits, worked out by fast_forward_mining() rather than stepped through
+	int bots;
+	double coins; // coins earned in total
+	int seals_broken[MAX_TIERS]; // how many bots got through each tier's seal
+	double seal_time[MAX_TIERS]; // and how long it took them, summed up
+	double level[SIM_MAX_HOURS][N_UPGRADES]; // summed up levels at the end of each hour
+	double tier[SIM_MAX_HOURS];
+} SimStats;
+
+// the floor isn't generated, just modeled: with one ore per ORE_CHANCE tiles
+// the next ore is about sqrt(ORE_CHANCE) tiles away, and the stairs about half a floor
+#define SIM_WALK_TIME (10.0*SCALE/(PLAYER_SPEED*SCALE/50))
+#define SIM_STAIRS_TIME (50.0*SCALE/(PLAYER_SPEED*SCALE/50))
+#define SIM_SLICE 1.0 // how often(in seconds) bots get to go shopping while mining
+#define SIM_SEAL_GIVEUP 30 // seconds of hitting a seal before a bot gives up on it
+
+unsigned int sim_rand(unsigned int *state) // xorshift, since rand() is shared
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+int cheapest_upgrade(Bot *b)
+{
+	int best = 0;
+	for(int i = 1; i < N_UPGRADES; i++)
+		if(b->level[i] < b->level[best])
+			best = i;
+	return best;
+}
+
+int dps_first(Bot *b) // speed and power until the next seal can be broken
+{
+	float dps = power_to_damage(b->level[POWER_UPGRADE]) / speed_to_delay(b->level[SPEED_UPGRADE]);
+	if(dps > tier_seal_dps[b->tier-1])
+		return cheapest_upgrade(b);
+	return b->level[SPEED_UPGRADE] <= b->level[POWER_UPGRADE] ? SPEED_UPGRADE : POWER_UPGRADE;
+}
+
+int skill_first(Bot *b) // skill is as good as the other two together
+{
+	if(b->level[SKILL_UPGRADE] <= b->level[SPEED_UPGRADE] + b->level[POWER_UPGRADE])
+		return SKILL_UPGRADE;
+	return cheapest_upgrade(b);
+}
+
+char any_ore(Bot *b, int category) { return category != RUBBLE; }
+char valuable_ore(Bot *b, int category) { return category >= MAIN; }
+
+BotStrategy strategies[] =
+{
+//	name		wants_ore	next_upgrade		ores_per_floor
+{	"greedy",	any_ore,	cheapest_upgrade,	20},
+{	"picky",	valuable_ore,	cheapest_upgrade,	20},
+{	"diver",	any_ore,	dps_first,		5},
+{	"investor",	any_ore,	skill_first,		20},
+};
+#define N_STRATEGIES (int)(sizeof(strategies)/sizeof(*strategies))
+
+void sim_shop(Bot *b, BotStrategy *s)
+{
+	for(;;)
+	{
+		int u = s->next_upgrade(b);
+		int total = b->level[SPEED_UPGRADE] + b->level[POWER_UPGRADE] + b->level[SKILL_UPGRADE];
+		int cost = upgrade_cost(b->level[u], total);
+		if(b->coins < cost) return;
+		b->coins -= cost;
+		b->level[u]++;
+	}
+}
+
+void sim_advance(Bot *b, double dt, SimStats *stats)
+// moves the bot's clock forward, noting down the upgrade curve on every full hour
+{
+	int hour = b->time/3600;
+	b->time += dt;
+	for(; hour < (int)(b->time/3600) && hour < SIM_MAX_HOURS; hour++)
+	{
+		for(int i = 0; i < N_UPGRADES; i++)
+			stats->level[hour][i] += b->level[i];
+		stats->tier[hour] += b->tier;
+	}
+}
+
+void sim_mine(Bot *b, BotStrategy *s, int category, SimStats *stats)
+{
+	int type = tier_ores[b->tier-1][category];
+	int amount = category_amount[category];
+	float wear = ores[type].durability;
+	float timer = speed_to_delay(b->level[SPEED_UPGRADE]); // the first hit lands right away, like in main()
+
+	while(amount > 0)
+	{
+		float delay = speed_to_delay(b->level[SPEED_UPGRADE]);
+		float start = timer;
+		timer += SIM_SLICE;
+		MiningResult r = fast_forward_mining(timer, delay, power_to_damage(b->level[POWER_UPGRADE]),
+			wear, ores[type].durability, amount, ores[type].value, skill_to_multiplier(b->level[SKILL_UPGRADE]));
+
+		stats->hits += r.hits;
+		stats->coins += r.coins;
+		b->coins += r.coins;
+		amount = r.amount;
+		wear = r.wear;
+		timer = r.time_left;
+		sim_advance(b, r.depleted ? r.hits*delay - start : SIM_SLICE, stats);
+		sim_shop(b, s);
+	}
+}
+
+char sim_break_seal(Bot *b, SimStats *stats)
+// hits a seal the way main() does, 60 frames a second: regen first, then mining
+{
+	float dt = 1.0/60;
+	float delay = speed_to_delay(b->level[SPEED_UPGRADE]);
+	float damage = power_to_damage(b->level[POWER_UPGRADE]);
+	int durability = damage*2;
+	float wear = damage*2, timer = delay;
+
+	for(int frame = 0; frame < 60*SIM_SEAL_GIVEUP; frame++)
+	{
+		if(wear < durability)
+		{
+			wear += dt*tier_seal_dps[b->tier-1];
+			if(wear > durability) wear = durability;
+		}
+		MiningResult r = fast_forward_mining(timer, delay, damage, wear, durability, 1, 0, 1);
+		stats->hits += r.hits;
+		wear = r.wear;
+		timer = r.time_left + dt;
+		b->time += dt;
+		if(r.depleted) return 1;
+	}
+	return 0;
+}
+
+void sim_bot(Bot *b, BotStrategy *s, double hours, SimStats *stats)
+{
+	int category_sum = 0;
+	for(int i = 0; i < N_CATEGORIES; i++)
+		category_sum += category_frequency[i];
+
+	int mined = 0;
+	while(b->time < hours*3600)
+	{
+		sim_advance(b, SIM_WALK_TIME, stats);
+
+		int n = sim_rand(&b->rng)%category_sum, category = 0;
+		for(int sum = category_frequency[0]; sum <= n; sum += category_frequency[++category]);
+		if(s->wants_ore(b, category))
+		{
+			sim_mine(b, s, category, stats);
+			mined++;
+		}
+		if(mined < s->ores_per_floor) continue;
+
+		mined = 0;
+		sim_advance(b, SIM_STAIRS_TIME, stats);
+
+		char entrance = 0;
+		for(int i = 0; i < STAIRS_PER_FLOOR; i++)
+			if(sim_rand(&b->rng)%1000 < next_tier_chance(b->floor))
+				entrance = 1;
+
+		if(entrance && b->tier < MAX_TIERS && sim_break_seal(b, stats))
+		{
+			stats->seals_broken[b->tier-1]++;
+			stats->seal_time[b->tier-1] += b->time/3600;
+			b->tier++;
+			b->floor = 1;
+		}
+		else b->floor++;
+	}
+}
+
+// Splits a job over forked worker processes: worker w of nworkers fills in a
+// result of result_size bytes and sends it back through a pipe, where
+// combine() adds it to total. A share that can't get a pipe or a process of
+// its own runs in this one instead.
+void run_forked(int nworkers, size_t result_size, void (*work)(int w, int nworkers, void *job, void *result),
+	void (*combine)(void *total, const void *part), void *job, void *total)
+{
+	int *pipes = malloc(sizeof(int)*nworkers);
+	pid_t *pids = malloc(sizeof(pid_t)*nworkers);
+	char *part = malloc(result_size);
+	for(int w = 0; w < nworkers; w++)
+	{
+		pids[w] = -1;
+		int fd[2];
+		if(pipe(fd) == 0)
+		{
+			pids[w] = fork();
+			if(pids[w] == 0)
+			{
+				close(fd[0]);
+				memset(part, 0, result_size);
+				work(w, nworkers, job, part);
+				write(fd[1], part, result_size);
+				_exit(0);
+			}
+			close(fd[1]);
+			if(pids[w] > 0)
+			{
+				pipes[w] = fd[0];
+				continue;
+			}
+			close(fd[0]);
+		}
+		memset(part, 0, result_size); // no worker for this share
+		work(w, nworkers, job, part);
+		combine(total, part);
+	}
+
+	for(int w = 0; w < nworkers; w++)
+	{
+		if(pids[w] <= 0) continue;
+		size_t got = 0;
+		ssize_t n;
+		while(got < result_size && (n = read(pipes[w], part + got, result_size - got)) > 0)
+			got += n;
+		close(pipes[w]);
+		waitpid(pids[w], NULL, 0);
+		if(got == result_size) // otherwise the worker died
+			combine(total, part);
+	}
+	free(part);
+	free(pids);
+	free(pipes);
+}
+
+typedef struct
+{
+	BotStrategy *s;
+	int nbots;
+	double hours;
+} SimJob;
+
+void sim_worker(int w, int nworkers, void *job, void *result) // runs every nworkers'th bot
+{
+	SimJob *j = job;
+	SimStats *mine = result;
+	for(int i = w; i < j->nbots; i += nworkers)
+	{
+		Bot b = {0};
+		b.tier = 1; b.floor = 1; // the surface entrance isn't sealed
+		b.rng = (worldseed ^ (i*2654435761u)) | 1;
+		sim_bot(&b, j->s, j->hours, mine);
+		mine->bots++;
+	}
+}
+
+void add_sim_stats(void *total, const void *part)
+{
+	SimStats *stats = total;
+	const SimStats *p = part;
+	stats->hits += p->hits;
+	stats->bots += p->bots;
+	stats->coins += p->coins;
+	for(int i = 0; i < MAX_TIERS; i++)
+	{
+		stats->seals_broken[i] += p->seals_broken[i];
+		stats->seal_time[i] += p->seal_time[i];
+	}
+	for(int h = 0; h < SIM_MAX_HOURS; h++)
+	{
+		for(int i = 0; i < N_UPGRADES; i++)
+			stats->level[h][i] += p->level[h][i];
+		stats->tier[h] += p->tier[h];
+	}
+}
+
+void simulate_strategy(BotStrategy *s, int nbots, double hours, int nworkers, SimStats *stats)
+{
+	SimJob job = {s, nbots, hours};
+	memset(stats, 0, sizeof(*stats));
+	run_forked(nworkers, sizeof(SimStats), sim_worker, add_sim_stats, &job, stats);
+}
+
+int run_simulator(int argc, char **argv)
+// silver_mountain --simulate [bots] [hours] [strategy]
+{
+	int nbots = argc > 0 ? atoi(argv[0]) : 1000;
+	double hours = argc > 1 ? atof(argv[1]) : 10;
+	char *only = argc > 2 ? argv[2] : NULL;
+	if(nbots <= 0 || hours <= 0)
+	{
+		fprintf(stderr, "usage: --simulate [bots] [hours] [strategy]\n");
+		return 1;
+	}
+	if(hours > SIM_MAX_HOURS) hours = SIM_MAX_HOURS;
+
+	int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nworkers < 1) nworkers = 1;
+	if(nworkers > nbots) nworkers = nbots;
+
+	for(int i = 0; i < N_STRATEGIES; i++)
+	{
+		BotStrategy *s = &strategies[i];
+		if(only && strcmp(only, s->name)) continue;
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		SimStats stats;
+		simulate_strategy(s, nbots, hours, nworkers, &stats);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+		if(stats.bots == 0) continue;
+
+		printf("== %s: %d bots, %.1f hours each ==\n", s->name, stats.bots, hours);
+		printf("coins per hour: %.0f\n", stats.coins/stats.bots/hours);
+		for(int t = 0; t < MAX_TIERS; t++)
+			if(stats.seals_broken[t])
+				printf("tier %d seal: broken by %d%% of bots, after %.2f hours on average\n",
+					t+1, 100*stats.seals_broken[t]/stats.bots, stats.seal_time[t]/stats.seals_broken[t]);
+		printf("hour\tspeed\tpower\tskill\ttier\n");
+		for(int h = 0; h < (int)hours; h++)
+			printf("%d\t%.1f\t%.1f\t%.1f\t%.2f\n", h+1,
+				stats.level[h][SPEED_UPGRADE]/stats.bots, stats.level[h][POWER_UPGRADE]/stats.bots,
+				stats.level[h][SKILL_UPGRADE]/stats.bots, stats.tier[h]/stats.bots);
+		printf("%.0f bot-hours in %.2fs on %d cores, %.0f bot-hours/s(%lld pickaxe hits, worked out rather than stepped)\n\n",
+			stats.bots*hours, secs, nworkers, stats.bots*hours/secs, stats.hits);
+	}
+	return 0;
+}
+
+// World seed analytics: generates lots of floors per seed with the real
+// generate_floor(), walking down random stairs the way a player would,
+// all in memory.
+
+#define SEED_MAX_FLOORS 64
+#define SEED_SLOW_TRIES 100 // floors that needed more spot picks than this get reported as slow
+
+typedef struct
+{
+	long long floors, tiles;
+	long long ores[N_CATEGORIES]; // ore tiles by category, seals not included
+	long long floors_at[SEED_MAX_FLOORS]; // floors generated at each mine_floor
+	long long entrances_at[SEED_MAX_FLOORS]; // how many of those had a mine entrance
+	long long tries; // random spots picked by place_random_*()
+	long long slow_floors;
+	int max_tries;
+} SeedStats;
+
+typedef struct
+{
+	double min_rare, min_srare; // per floor, on average
+	int entrance_by; // there has to be an entrance at this mine_floor or above
+} SeedCriteria;
+
+int ore_category(int type)
+{
+	for(int i = 0; i < N_CATEGORIES; i++)
+		if(tier_ores[tier-1][i] == type)
+			return i;
+	return -1;
+}
+
+void analyze_seed(int seed, int walks, int floors, SeedStats *stats, SeedCriteria *criteria)
+{
+	reserve_path(floors);
+	long long rare = 0, srare = 0, generated = 0;
+	int first_entrance = -1;
+
+	worldseed = seed;
+	for(int w = 0; w < walks; w++)
+	{
+		unsigned int rng = (seed ^ (w*2654435761u)) | 1;
+
+		// start at the surface entrance, like descend_floor() from the surface
+		path[0] = (MPath){10, 10, 1, 0};
+		depth = 1; tier = 1; mine_floor = 1;
+		for(;;)
+		{
+			placement_tries = 0;
+			generate_floor();
+			generated++;
+
+			int2 exits[STAIRS_PER_FLOOR];
+			int nexits = 0;
+			char entrance = 0;
+			for(int x = 0; x < object_tiles.wid; x++)
+			for(int y = 0; y < object_tiles.hei; y++)
+			{
+				int t = object_tiles.tiles[x][y];
+				if(t == ORE && ore_map[x][y].type != SEAL)
+				{
+					int c = ore_category(ore_map[x][y].type);
+					stats->ores[c]++;
+					if(c == RARE) rare++;
+					if(c == SRARE) srare++;
+				}
+				if(t == ENTRANCE) entrance = 1;
+				if((t == STAIRS || t == ENTRANCE) && nexits < STAIRS_PER_FLOOR)
+					exits[nexits++] = (int2){x, y};
+			}
+
+			stats->floors++;
+			stats->tiles += object_tiles.wid*object_tiles.hei;
+			stats->tries += placement_tries;
+			if(placement_tries > stats->max_tries) stats->max_tries = placement_tries;
+			if(placement_tries > SEED_SLOW_TRIES) stats->slow_floors++;
+			if(mine_floor <= SEED_MAX_FLOORS)
+			{
+				stats->floors_at[mine_floor-1]++;
+				stats->entrances_at[mine_floor-1] += entrance;
+			}
+			if(entrance && tier == 1 && (first_entrance == -1 || mine_floor < first_entrance))
+				first_entrance = mine_floor;
+
+			if(depth >= floors || nexits == 0) break;
+
+			// take a random way down, same bookkeeping as descend_floor()
+			int2 e = exits[sim_rand(&rng)%nexits];
+			char stairs = object_tiles.tiles[e.x][e.y] == STAIRS;
+			path[depth++] = (MPath){e.x, e.y, mine_floor, stairs};
+			if(stairs)
+				mine_floor++;
+			else
+			{
+				mine_floor = 1;
+				tier++;
+				if(tier > MAX_TIERS) tier = MAX_TIERS;
+			}
+		}
+	}
+	depth = 0;
+
+	if(criteria)
+	{
+		if((double)rare/generated < criteria->min_rare) return;
+		if((double)srare/generated < criteria->min_srare) return;
+		if(criteria->entrance_by && (first_entrance == -1 || first_entrance > criteria->entrance_by)) return;
+		printf("seed %d: %.2f rare, %.2f super rare per floor, first entrance on floor %d\n",
+			seed, (double)rare/generated, (double)srare/generated, first_entrance);
+		fflush(stdout);
+	}
+}
+
+typedef struct
+{
+	int first, count, walks, floors;
+	SeedCriteria *criteria;
+} SeedJob;
+
+void seed_worker(int w, int nworkers, void *job, void *result) // every nworkers'th seed
+{
+	SeedJob *j = job;
+	for(int i = w; i < j->count; i += nworkers)
+		analyze_seed(j->first+i, j->walks, j->floors, result, j->criteria);
+}
+
+void add_seed_stats(void *total, const void *part)
+{
+	SeedStats *stats = total;
+	const SeedStats *p = part;
+	stats->floors += p->floors;
+	stats->tiles += p->tiles;
+	for(int i = 0; i < N_CATEGORIES; i++)
+		stats->ores[i] += p->ores[i];
+	for(int i = 0; i < SEED_MAX_FLOORS; i++)
+	{
+		stats->floors_at[i] += p->floors_at[i];
+		stats->entrances_at[i] += p->entrances_at[i];
+	}
+	stats->tries += p->tries;
+	stats->slow_floors += p->slow_floors;
+	if(p->max_tries > stats->max_tries) stats->max_tries = p->max_tries;
+}
+
+int run_seed_analytics(int argc, char **argv)
+// silver_mountain --seeds first count [walks] [floors] [--min-rare N] [--min-srare N] [--entrance-by FLOOR] [--veins]
+{
+	int positional[4] = {0, 1000, 10, 20}, npositional = 0;
+	SeedCriteria criteria = {0};
+	char search = 0;
+	for(int i = 0; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "--min-rare") && i+1 < argc)
+			{ criteria.min_rare = atof(argv[++i]); search = 1; }
+		else if(!strcmp(argv[i], "--min-srare") && i+1 < argc)
+			{ criteria.min_srare = atof(argv[++i]); search = 1; }
+		else if(!strcmp(argv[i], "--entrance-by") && i+1 < argc)
+			{ criteria.entrance_by = atoi(argv[++i]); search = 1; }
+		else if(!strcmp(argv[i], "--veins"))
+			ore_veins = 1;
+		else if(npositional < 4)
+			positional[npositional++] = atoi(argv[i]);
+	}
+	int first = positional[0], count = positional[1], walks = positional[2], floors = positional[3];
+	if(count <= 0 || walks <= 0 || floors <= 0)
+	{
+		fprintf(stderr, "usage: --seeds first count [walks] [floors] [--min-rare N] [--min-srare N] [--entrance-by FLOOR] [--veins]\n");
+		return 1;
+	}
+
+	int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nworkers < 1) nworkers = 1;
+	if(nworkers > count) nworkers = count;
+
+	allocate_floor(100, 100);
+	setvbuf(stdout, NULL, _IOLBF, 0); // so that the workers' lines don't get mixed up
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	SeedJob job = {first, count, walks, floors, search ? &criteria : NULL};
+	SeedStats stats = {0};
+	run_forked(nworkers, sizeof(SeedStats), seed_worker, add_seed_stats, &job, &stats);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+	if(stats.floors == 0) return 1;
+
+	char *category_names[N_CATEGORIES] = {"rubble", "mass", "main", "rare", "super rare"};
+	printf("== seeds %d-%d: %lld floors, %d walks of up to %d floors per seed ==\n", first, first+count-1, stats.floors, walks, floors);
+	for(int i = 0; i < N_CATEGORIES; i++)
+		printf("%s:\t%.2f per floor, %.3f per 1000 tiles\n", category_names[i],
+			(double)stats.ores[i]/stats.floors, 1000.0*stats.ores[i]/stats.tiles);
+	printf("floor\tentrance chance\n");
+	for(int i = 0; i < SEED_MAX_FLOORS; i++)
+		if(stats.floors_at[i])
+			printf("%d\t%.1f%%\n", i+1, 100.0*stats.entrances_at[i]/stats.floors_at[i]);
+	printf("stairs placement: %.2f spots tried per floor, %d at worst, %lld floors over %d\n",
+		(double)stats.tries/stats.floors, stats.max_tries, stats.slow_floors, SEED_SLOW_TRIES);
+	printf("%.2fs on %d cores, %.0f floors/s\n", secs, nworkers, stats.floors/secs);
+	return 0;
+}
+
+// The simulation runs in fixed steps no matter the frame rate, so it plays out
+// the same on any machine and a long frame can't make the player skip
+// through a wall. Rendering interpolates between the last two steps.
+#define SIM_RATE 60 // simulation steps per second
+#define SIM_DT (1.0/SIM_RATE)
+#define MAX_FRAME_TIME 0.25 // a longer frame is cut short, instead of spending ages catching up
+
+// Input gets read once per frame into one struct, which the rest of the game
+// reads from. That way a session's input can be written to a file and fed
+// back in later, giving the exact same game again(see --record and --replay).
+
+enum INPUT_BITS
+{
+	IN_UP, IN_LEFT, IN_DOWN, IN_RIGHT, // held down
+	IN_SPEED, IN_POWER, IN_SKILL, IN_CYCLE, IN_REMOVE, // pressed this frame
+	IN_NAV_STAIRS, IN_NAV_UPSTAIRS, IN_NAV_ENTRANCE, IN_NAV_ORE, IN_CLICK
+};
+#define HELD_BITS 4
+#define INPUT(b) ((input.keys >> (b)) & 1)
+
+typedef struct
+{
+	unsigned short keys; // one bit per INPUT_BITS
+	Vector2 mouse; // where the click landed, in world coordinates
+	float wheel;
+	float dt; // frame time
+} FrameInput;
+FrameInput input = {0};
+
+void read_input()
+{
+	static const int keys[][2] = {
+		[IN_UP] = {KEY_W, KEY_UP}, [IN_LEFT] = {KEY_A, KEY_LEFT},
+		[IN_DOWN] = {KEY_S, KEY_DOWN}, [IN_RIGHT] = {KEY_D, KEY_RIGHT},
+		[IN_SPEED] = {KEY_F}, [IN_POWER] = {KEY_P}, [IN_SKILL] = {KEY_X},
+		[IN_CYCLE] = {KEY_C}, [IN_REMOVE] = {KEY_R},
+		[IN_NAV_STAIRS] = {KEY_ONE}, [IN_NAV_UPSTAIRS] = {KEY_TWO},
+		[IN_NAV_ENTRANCE] = {KEY_THREE}, [IN_NAV_ORE] = {KEY_FOUR}
+	};
+
+	input.keys = 0;
+	for(int b = 0; b < IN_CLICK; b++)
+	for(int k = 0; k < 2 && keys[b][k]; k++)
+		if(b < HELD_BITS ? IsKeyDown(keys[b][k]) : IsKeyPressed(keys[b][k]))
+			input.keys |= 1 << b;
+
+	if(IsMouseButtonPressed(MOUSE_BUTTON_LEFT))
+	{
+		input.keys |= 1 << IN_CLICK;
+		input.mouse = GetScreenToWorld2D(GetMousePosition(), camera);
+	}
+	input.wheel = GetMouseWheelMove();
+	input.dt = GetFrameTime();
+}
+
+// The state hash covers everything the simulation touches, so replays that
+// drift apart get caught within a second
+unsigned long long hash_bytes(unsigned long long h, const void *data, size_t n)
+{
+	const unsigned char *p = data;
+	for(size_t i = 0; i < n; i++)
+		h = (h ^ p[i]) * 1099511628211ULL; // FNV-1a
+	return h;
+}
+#define HASH_VAR(h, v) h = hash_bytes(h, &(v), sizeof(v))
+
+unsigned long long state_hash()
+{
+	unsigned long long h = 14695981039346656037ULL;
+	HASH_VAR(h, coins);
+	HASH_VAR(h, mining_speed); HASH_VAR(h, mining_power); HASH_VAR(h, mining_skill);
+	HASH_VAR(h, depth); HASH_VAR(h, mine_floor); HASH_VAR(h, tier);
+	HASH_VAR(h, player.x); HASH_VAR(h, player.y);
+	HASH_VAR(h, player_mode); HASH_VAR(h, mining_target); HASH_VAR(h, time_since_last_mined);
+	HASH_VAR(h, nav_target); HASH_VAR(h, ncheckpoints); HASH_VAR(h, miners.n);
+	for(int x = 0; x < object_tiles.wid; x++)
+	{
+		h = hash_bytes(h, object_tiles.tiles[x], sizeof(int)*object_tiles.hei);
+		for(int y = 0; y < object_tiles.hei; y++)
+			if(object_tiles.tiles[x][y] == ORE) // the rest of ore_map is left over from other floors
+				h = hash_bytes(h, &ore_map[x][y], sizeof(Ore));
+	}
+	return h;
+}
+
+// Recording format: a header(magic, world seed, whether ore veins are on,
+// then the player data just like player.dat), then one record per frame. A
+// record is a flags byte holding the held keys and which fields follow, so
+// at a steady frame rate most frames take a single byte.
+#define RECORDING_MAGIC 0x32434552 // "REC2"
+#define RECORDING_MAGIC_V1 0x31434552 // "REC1", from before ore veins: the same without the veins byte
+#define HASH_INTERVAL 60 // frames between state hashes
+
+enum RECORD_FLAGS {REC_PRESSED = 1<<HELD_BITS, REC_WHEEL = 1<<5, REC_DT = 1<<6, REC_HASH = 1<<7};
+
+FILE *recording = NULL, *replaying = NULL;
+long long rec_frame = 0; // frames recorded or replayed so far
+float rec_dt = 0; // the last frame time written/read; only changes get stored
+char rec_hashed = 0; // whether the frame being replayed has a state hash after it
+
+void write_recording_header(FILE *f)
+{
+	unsigned magic = RECORDING_MAGIC;
+	fwrite(&magic, sizeof(magic), 1, f);
+	fwrite(&worldseed, sizeof(worldseed), 1, f);
+	fwrite(&ore_veins, sizeof(ore_veins), 1, f);
+	write_player_data(f);
+}
+
+char read_recording_header(FILE *f)
+{
+	unsigned magic = 0;
+	fread(&magic, sizeof(magic), 1, f);
+	if(magic != RECORDING_MAGIC && magic != RECORDING_MAGIC_V1) return 0;
+	fread(&worldseed, sizeof(worldseed), 1, f);
+	ore_veins = 0;
+	if(magic == RECORDING_MAGIC)
+		fread(&ore_veins, sizeof(ore_veins), 1, f);
+	read_player_data(f);
+	return 1;
+}
+
+void write_frame(FILE *f) // a state hash gets appended by end_frame(), after the frame ran
+{
+	unsigned char flags = input.keys & ((1<<HELD_BITS)-1);
+	unsigned short pressed = input.keys >> HELD_BITS;
+	if(pressed) flags |= REC_PRESSED;
+	if(input.wheel != 0) flags |= REC_WHEEL;
+	if(input.dt != rec_dt) flags |= REC_DT;
+	if((rec_frame+1) % HASH_INTERVAL == 0) flags |= REC_HASH;
+
+	putc(flags, f);
+	if(flags & REC_PRESSED) fwrite(&pressed, sizeof(pressed), 1, f);
+	if(INPUT(IN_CLICK)) fwrite(&input.mouse, sizeof(input.mouse), 1, f);
+	if(flags & REC_WHEEL) fwrite(&input.wheel, sizeof(input.wheel), 1, f);
+	if(flags & REC_DT) fwrite(&input.dt, sizeof(input.dt), 1, f);
+	rec_dt = input.dt;
+}
+
+char read_frame(FILE *f) // returns 0 at the end of the recording
+{
+	int flags = getc(f);
+	if(flags == EOF) return 0;
+
+	unsigned short pressed = 0;
+	if(flags & REC_PRESSED) fread(&pressed, sizeof(pressed), 1, f);
+	input.keys = (flags & ((1<<HELD_BITS)-1)) | pressed << HELD_BITS;
+	if(INPUT(IN_CLICK)) fread(&input.mouse, sizeof(input.mouse), 1, f);
+	input.wheel = 0;
+	if(flags & REC_WHEEL) fread(&input.wheel, sizeof(input.wheel), 1, f);
+	if(flags & REC_DT) fread(&rec_dt, sizeof(rec_dt), 1, f);
+	input.dt = rec_dt;
+	rec_hashed = (flags & REC_HASH) != 0;
+	return !feof(f);
+}
+
+char end_frame() // after a frame ran; returns 0 if a replay went out of sync
+{
+	rec_frame++;
+	char hashed = rec_frame % HASH_INTERVAL == 0;
+	if(replaying && rec_hashed != hashed)
+	{
+		printf("Replay is damaged at frame %lld(its hash flag says %d, expected %d).\n", rec_frame, rec_hashed, hashed);
+		return 0;
+	}
+	if(!hashed) return 1;
+
+	unsigned long long h = state_hash(), expected;
+	if(recording)
+		fwrite(&h, sizeof(h), 1, recording);
+	if(replaying)
+	{
+		if(fread(&expected, sizeof(expected), 1, replaying) != 1) return 1; // cut off recording
+		if(h != expected)
+		{
+			printf("Replay out of sync at frame %lld(hash %016llx, recorded %016llx).\n", rec_frame, h, expected);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Recorded and replayed sessions play on a fresh copy of the world in a
+// scratch directory, so they never touch the real save, and the replay starts
+// from the exact same floors the recording did.
+char scratch_dir[] = "/tmp/silver_mountain_XXXXXX";
+
+void remove_tree(const char *dir)
+{
+	DIR *d = opendir(dir);
+	if(d == NULL) return;
+	struct dirent *e;
+	char name[4096];
+	while((e = readdir(d)) != NULL)
+	{
+		if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+		snprintf(name, sizeof(name), "%s/%s", dir, e->d_name);
+		struct stat st;
+		if(lstat(name, &st) == 0 && S_ISDIR(st.st_mode))
+			remove_tree(name);
+		else
+			unlink(name);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+// The journal: between full saves, every tile change and every change to the
+// coins or upgrade levels is appended to journal.dat, so a crash loses at most
+// JOURNAL_INTERVAL of progress instead of everything since the last floor
+// transition. Changes are gathered into a batch and committed together, once
+// the oldest one is JOURNAL_INTERVAL old or the batch fills up. The write and
+// the fsync happen on a thread of their own: the game hands it the full batch
+// and goes on filling the other one. Records hold the new state rather than a
+// difference, so replaying one twice does no harm, and a tile hit many times
+// before a commit only takes up one record.
+//
+// Format: a header(magic, the depth of the floor and the entrances leading to
+// it), then batches: a JournalBatch followed by its records, each a kind byte
+// and a JournalTile or JournalPlayer. A batch whose hash doesn't match was cut
+// short by the crash and ends the journal.
+//
+// A checkpoint saves the floor(unless a transition just did) and the player,
+// and starts the journal over: on every new floor, when the checkpoints change
+// and when the journal outgrows JOURNAL_COMPACT. The saves themselves aren't
+// fsync'd; instead the writer fsyncs every file saved since the last
+// checkpoint before it starts the journal over. A clean exit saves everything
+// and removes it.
+#define JOURNAL_MAGIC "JRN1"
+#define JOURNAL_INTERVAL 0.25 // seconds
+#define JOURNAL_BATCH 16384 // bytes
+_Static_assert(JOURNAL_BATCH <= 65536, "journal_slot holds offsets into the batch");
+#define JOURNAL_COMPACT (1<<20) // bytes
+
+enum JOURNAL_RECORDS { JOURNAL_TILE, JOURNAL_PLAYER };
+
+typedef struct
+{
+	unsigned short x, y;
+	int tile, type, amount;
+	float wear, regen;
+} JournalTile;
+
+typedef struct
+{
+	int coins, speed, power, skill;
+} JournalPlayer;
+
+typedef struct
+{
+	unsigned long long hash; // of the records
+	int len, records;
+} JournalBatch;
+
+typedef struct
+{
+	unsigned char batch[JOURNAL_BATCH];
+	int len, records;
+	char restart; // start the journal over before writing the batch
+	unsigned char *header; int header_len; // of the new journal
+	char **files; int nfiles; // to fsync before starting over
+} JournalJob;
+
+char journal_file[4096] = "journal.dat"; // made absolute at startup, like player_file
+char journaling = 0; // only while playing on the real save
+FILE *journal = NULL; // the writer thread's
+
+JournalJob journal_jobs[2];
+JournalJob *journal_job = &journal_jobs[0]; // being filled by the game
+JournalJob *journal_pending = NULL; // handed to the writer, NULL once it's done
+char journal_stopping = 0;
+pthread_t journal_thread;
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+char **journal_saves = NULL; // files saved since the last checkpoint, absolute
+int njournal_saves = 0, journal_saves_capacity = 0;
+
+long long journal_size = 0; // once everything handed off is written
+TileCursor journal_cursor;
+JournalPlayer journal_player; // as of the last record
+int journal_checkpoints = 0; // ncheckpoints as of the last checkpoint
+int journal_player_slot = 0; // the same for the player's
+double journal_oldest = 0; // when the oldest uncommitted change came in
+
+double journal_clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec/1e9;
+}
+
+JournalPlayer current_player()
+{
+	return (JournalPlayer){coins, mining_speed, mining_power, mining_skill};
+}
+
+void sync_path(const char *name) // a file saved earlier, and its name
+{
+	int fd = open(name, O_RDONLY);
+	if(fd >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+	sync_dir(name);
+}
+
+void write_journal_job(JournalJob *j) // on the writer thread
+{
+	if(j->restart)
+	{
+		for(int i = 0; i < j->nfiles; i++)
+			sync_path(j->files[i]);
+		if(journal) fclose(journal);
+		journal = fopen(journal_file, "wb");
+		if(journal) fwrite(j->header, 1, j->header_len, journal);
+	}
+	if(journal == NULL) return; // no journal, but the game goes on
+	if(j->len > 0)
+	{
+		JournalBatch b = {hash_bytes(14695981039346656037ULL, j->batch, j->len), j->len, j->records};
+		fwrite(&b, sizeof(b), 1, journal);
+		fwrite(j->batch, 1, j->len, journal);
+	}
+	sync_file(journal);
+}
+
+void *journal_writer(void *arg)
+{
+	pthread_mutex_lock(&journal_lock);
+	while(1)
+	{
+		while(journal_pending == NULL && !journal_stopping)
+			pthread_cond_wait(&journal_cond, &journal_lock);
+		if(journal_pending == NULL) break; // stopping, with nothing left to write
+		JournalJob *j = journal_pending;
+		pthread_mutex_unlock(&journal_lock);
+		write_journal_job(j);
+		pthread_mutex_lock(&journal_lock);
+		journal_pending = NULL;
+		pthread_cond_broadcast(&journal_cond);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return NULL;
+}
+
+void reset_job(JournalJob *j)
+{
+	j->len = j->records = 0;
+	j->restart = 0;
+	free(j->header);
+	j->header = NULL;
+	for(int i = 0; i < j->nfiles; i++)
+		free(j->files[i]);
+	free(j->files);
+	j->files = NULL;
+	j->nfiles = 0;
+}
+
+void forget_slots() // the batch is handed off or dropped, so its records can't be updated any more
+{
+	JournalJob *j = journal_job;
+	for(int i = 0; i < j->len; )
+	{
+		int kind = j->batch[i++];
+		if(kind == JOURNAL_TILE)
+		{
+			JournalTile t;
+			memcpy(&t, j->batch + i, sizeof(t));
+			if(t.x < object_tiles.wid && t.y < object_tiles.hei) // the record can be from the last floor
+				journal_slot[t.x][t.y] = 0;
+			i += sizeof(t);
+		}
+		else i += sizeof(JournalPlayer);
+	}
+	journal_player_slot = 0;
+}
+
+char hand_off_journal(char wait) // the group commit; returns 0 if the writer is still busy
+{
+	pthread_mutex_lock(&journal_lock);
+	while(wait && journal_pending != NULL)
+		pthread_cond_wait(&journal_cond, &journal_lock);
+	if(journal_pending != NULL)
+	{
+		pthread_mutex_unlock(&journal_lock);
+		return 0;
+	}
+
+	forget_slots();
+	JournalJob *j = journal_job;
+	if(j->len > 0)
+	{
+		journal_size += sizeof(JournalBatch) + j->len;
+		telemetry.journal_commits++;
+		telemetry.journal_bytes += sizeof(JournalBatch) + j->len;
+	}
+	journal_job = j == &journal_jobs[0] ? &journal_jobs[1] : &journal_jobs[0];
+	journal_pending = j;
+	pthread_cond_broadcast(&journal_cond);
+	pthread_mutex_unlock(&journal_lock);
+
+	reset_job(journal_job); // written by now
+	return 1;
+}
+
+int journal_record(int kind, const void *record, int size) // returns the record's slot
+{
+	JournalJob *j = journal_job;
+	if(j->len + 1 + size > JOURNAL_BATCH)
+	{
+		hand_off_journal(1);
+		j = journal_job;
+	}
+	if(j->len == 0)
+		journal_oldest = journal_clock();
+	j->batch[j->len++] = kind;
+	memcpy(j->batch + j->len, record, size);
+	j->len += size;
+	j->records++;
+	return j->len - size;
+}
+
+void journal_tile(JournalTile *t)
+{
+	int slot = journal_slot[t->x][t->y];
+	if(slot) memcpy(journal_job->batch + slot, t, sizeof(*t));
+	else journal_slot[t->x][t->y] = journal_record(JOURNAL_TILE, t, sizeof(*t));
+}
+
+void journal_player_record(JournalPlayer *p)
+{
+	if(journal_player_slot) memcpy(journal_job->batch + journal_player_slot, p, sizeof(*p));
+	else journal_player_slot = journal_record(JOURNAL_PLAYER, p, sizeof(*p));
+}
+
+void journal_saved(const char *name) // called by end_save()
+{
+	if(!journaling) return;
+	char full[4096 + 16];
+	if(name[0] == '/')
+		snprintf(full, sizeof(full), "%s", name);
+	else
+	{
+		char cwd[4096];
+		if(getcwd(cwd, sizeof(cwd)) == NULL) return;
+		snprintf(full, sizeof(full), "%s/%s", cwd, name);
+	}
+	for(int i = 0; i < njournal_saves; i++)
+		if(!strcmp(journal_saves[i], full))
+			return;
+	if(njournal_saves == journal_saves_capacity)
+	{
+		journal_saves_capacity = journal_saves_capacity ? journal_saves_capacity*2 : 8;
+		journal_saves = realloc(journal_saves, sizeof(*journal_saves)*journal_saves_capacity);
+	}
+	journal_saves[njournal_saves++] = strdup(full);
+}
+
+void restart_journal() // once everything the journal holds is saved(not necessarily on disk yet)
+{
+	JournalJob *j = journal_job;
+	forget_slots();
+	j->len = j->records = 0; // older than the saves
+	j->restart = 1;
+
+	// the saves have to reach the disk before the journal can forget them
+	j->files = realloc(j->files, sizeof(*j->files)*(j->nfiles + njournal_saves));
+	for(int i = 0; i < njournal_saves; i++)
+		j->files[j->nfiles++] = journal_saves[i];
+	njournal_saves = 0;
+
+	free(j->header);
+	j->header_len = 4 + sizeof(depth) + depth*sizeof(int2);
+	j->header = malloc(j->header_len);
+	memcpy(j->header, JOURNAL_MAGIC, 4);
+	memcpy(j->header + 4, &depth, sizeof(depth));
+	for(int i = 0; i < depth; i++)
+	{
+		int2 entrance = {path[i].x, path[i].y};
+		memcpy(j->header + 4 + sizeof(depth) + i*sizeof(int2), &entrance, sizeof(entrance));
+	}
+	journal_size = j->header_len;
+
+	skip_tile_events(&journal_cursor);
+	journal_player = current_player();
+	journal_checkpoints = ncheckpoints;
+	hand_off_journal(0); // if the writer is busy, it goes with the next commit
+}
+
+void checkpoint_journal(char floor) // floor: whether the floor has to be saved too
+{
+	if(floor) save_floor();
+	save_player_data();
+	restart_journal();
+	telemetry.journal_checkpoints++;
+}
+
+void open_journal()
+{
+	journaling = 1;
+	journal_stopping = 0;
+	pthread_create(&journal_thread, NULL, journal_writer, NULL);
+	restart_journal();
+}
+
+void close_journal() // after a clean exit saved everything
+{
+	if(!journaling) return;
+	pthread_mutex_lock(&journal_lock);
+	journal_stopping = 1;
+	pthread_cond_broadcast(&journal_cond);
+	pthread_mutex_unlock(&journal_lock);
+	pthread_join(journal_thread, NULL); // after it wrote what it had
+	journaling = 0;
+
+	// a restart that never got handed off still holds saves that have to stick
+	for(int i = 0; i < journal_job->nfiles; i++)
+		sync_path(journal_job->files[i]);
+	reset_job(journal_job);
+
+	for(int i = 0; i < njournal_saves; i++) // the last saves have to stick before the journal goes
+	{
+		sync_path(journal_saves[i]);
+		free(journal_saves[i]);
+	}
+	njournal_saves = 0;
+	if(journal) fclose(journal);
+	journal = NULL;
+	unlink(journal_file);
+}
+
+void journal_tick() // once a frame
+{
+	if(!journaling) return;
+
+	if(journal_cursor.floor != tile_events_floor) // a whole new floor, saved on the way here
+	{
+		long long start = tile_events_floor_start;
+		checkpoint_journal(tile_events_head - start > TILE_EVENTS);
+		if(tile_events_head - start <= TILE_EVENTS)
+			journal_cursor.next = start; // changes since it got loaded aren't in its file
+	}
+	else if(tile_events_lost(&journal_cursor)) // more changes than the ring holds
+		checkpoint_journal(1);
+	else if(ncheckpoints != journal_checkpoints)
+		checkpoint_journal(1);
+
+	TileEvent *e;
+	while((e = next_tile_event(&journal_cursor)) != NULL)
+	{
+		JournalTile t = {e->x, e->y, e->tile, e->type, e->amount, e->wear, e->regen};
+		journal_tile(&t);
+	}
+
+	JournalPlayer p = current_player();
+	if(memcmp(&p, &journal_player, sizeof(p)))
+	{
+		journal_player_record(&p);
+		journal_player = p;
+	}
+
+	if(journal_job->restart || (journal_job->len > 0 && journal_clock() - journal_oldest >= JOURNAL_INTERVAL))
+		hand_off_journal(0); // if the writer is still busy, the batch keeps growing
+	if(journal_size > JOURNAL_COMPACT)
+		checkpoint_journal(1);
+}
+
+int recover_journal() // at startup, puts back what a crashed game hadn't saved; returns how many changes
+{
+	FILE *f = fopen(journal_file, "rb");
+	if(f == NULL) return 0; // the last game exited cleanly
+
+	char magic[4];
+	int jdepth;
+	if(fread(magic, 4, 1, f) != 1 || memcmp(magic, JOURNAL_MAGIC, 4) || fread(&jdepth, sizeof(jdepth), 1, f) != 1 || jdepth < 0)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	load_player_data();
+
+	// go down to the floor the changes are for
+	int steps = 0;
+	char floor = 1;
+	for(int i = 0; i < jdepth; i++)
+	{
+		int2 entrance;
+		if(fread(&entrance, sizeof(entrance), 1, f) != 1)
+		{
+			floor = 0;
+			break;
+		}
+		if(!floor) continue;
+		if(chdir(TextFormat("%d-%d", entrance.x, entrance.y)) == 0) steps++;
+		else floor = 0;
+	}
+	if(floor) floor = load_floor();
+
+	int changes = 0;
+	unsigned char *batch = journal_jobs[0].batch; // not in use yet
+	JournalBatch b;
+	while(fread(&b, sizeof(b), 1, f) == 1)
+	{
+		if(b.len <= 0 || b.len > JOURNAL_BATCH || fread(batch, 1, b.len, f) != (size_t)b.len
+			|| hash_bytes(14695981039346656037ULL, batch, b.len) != b.hash)
+			break; // the crash cut it short
+
+		for(int i = 0; i < b.len; )
+		{
+			int kind = batch[i++];
+			if(kind == JOURNAL_TILE)
+			{
+				JournalTile t;
+				memcpy(&t, batch + i, sizeof(t));
+				i += sizeof(t);
+				if(!floor || t.x >= object_tiles.wid || t.y >= object_tiles.hei) continue;
+				object_tiles.tiles[t.x][t.y] = t.tile;
+				if(t.tile == ORE)
+					ore_map[t.x][t.y] = (Ore){t.type, t.amount, t.regen, t.wear};
+			}
+			else if(kind == JOURNAL_PLAYER)
+			{
+				JournalPlayer p;
+				memcpy(&p, batch + i, sizeof(p));
+				i += sizeof(p);
+				coins = p.coins;
+				mining_speed = p.speed;
+				mining_power = p.power;
+				mining_skill = p.skill;
+			}
+			else break;
+			changes++;
+		}
+	}
+	fclose(f);
+
+	sync_saves = 1;
+	if(floor) save_floor();
+	while(steps-- > 0) chdir("..");
+	save_player_data();
+	sync_saves = 0;
+	unlink(journal_file);
+	return changes;
+}
+
+char *ore_name; int prev_amount;
+// both vars are for displaying the "Ore x amount" message at the bottom
+// when mining
+
+int which_checkpoint = 0;
+// which checkpoint we're currently cycling through(the index)
+
+void handle_input() // key presses and clicks, once per frame
+{
+	if(INPUT(IN_SPEED))
+		UpgradeMiningSpeed();
+	if(INPUT(IN_POWER))
+		UpgradeMiningPower();
+	if(INPUT(IN_SKILL))
+		UpgradeMiningSkill();
+
+	if(INPUT(IN_CYCLE) && ncheckpoints > 0) // cycle checkpoints
+	{
+		which_checkpoint++;
+		which_checkpoint %= ncheckpoints;
+		GoToCheckpoint(which_checkpoint);
+		player_mode = MOVING;
+	}
+	if(INPUT(IN_REMOVE) && ncheckpoints > 0) // remove checkpoint
+	{
+		RemoveCheckpoint(which_checkpoint);
+	}
+
+	// auto-walk
+	if(INPUT(IN_NAV_STAIRS))
+		toggle_auto_walk(NAV_STAIRS);
+	if(INPUT(IN_NAV_UPSTAIRS))
+		toggle_auto_walk(NAV_UPSTAIRS);
+	if(INPUT(IN_NAV_ENTRANCE))
+		toggle_auto_walk(NAV_ENTRANCE);
+	if(INPUT(IN_NAV_ORE) && nav_ore_type != -1) // the last ore mined
+		toggle_auto_walk(NAV_ORE);
+
+	if(INPUT(IN_CLICK))
+	{
+		Vector2 mpos = input.mouse;
+		Vector2 player_pos = (Vector2){player.x+player.width/2, player.y+player.height/2};
+		int tilex, tiley;
+		tilex = (int)(mpos.x/SCALE);
+		tiley = (int)(mpos.y/SCALE);
+
+		if(Vector2Distance(mpos, player_pos) <= 2*SCALE)
+		if(tilex >= 0 && tilex < object_tiles.wid && tiley >= 0 && tiley < object_tiles.hei)
+		if(object_tiles.tiles[tilex][tiley] == ORE)
+		if(player_mode != MINING)
+		{
+			player_mode = MINING;
+			mining_target = (int2){tilex, tiley};
+			time_since_last_mined = mining_delay;
+			prev_amount = ore_map[tilex][tiley].amount;
+			ore_name = ores[ore_map[tilex][tiley].type].name;
+			if(ore_map[tilex][tiley].type != SEAL)
+				select_nav_ore(ore_map[tilex][tiley].type);
+		}
+	}
+
+	if(input.wheel != 0)
+		camera.zoom = Clamp(camera.zoom * powf(1.1, input.wheel), MIN_ZOOM, MAX_ZOOM);
+}
+
+void simulate_step(float dt)
+{
+	Rectangle prev_player_pos = player;
+	if(input.keys & ((1<<HELD_BITS)-1))
+		nav_target = -1; // walking by hand turns it off
+	else if(nav_target != -1)
+		auto_walk(dt);
+
+	if(INPUT(IN_UP))
+		player.y -= dt*PLAYER_SPEED*SCALE/50;
+	if(INPUT(IN_LEFT))
+		player.x -= dt*PLAYER_SPEED*SCALE/50;
+	if(INPUT(IN_DOWN))
+		player.y += dt*PLAYER_SPEED*SCALE/50;
+	if(INPUT(IN_RIGHT))
+		player.x += dt*PLAYER_SPEED*SCALE/50;
+
+	collide_with_walls(&player, prev_player_pos);
+
+	if(player.x < 0) player.x = 0;
+	if(player.y < 0) player.y = 0;
+	if(player.x+player.width > MAP_WID) player.x = MAP_WID-player.width;
+	if(player.y+player.height > MAP_HEI) player.y = MAP_HEI-player.height;
+
+	if(player.x != prev_player_pos.x || player.y != prev_player_pos.y)
+		player_mode = MOVING;
+	if(player_mode == MOVING)
+		mining_target = (int2){-1, -1};
+
+	ores[SEAL].durability = mining_damage*2;
+	RegenerateOres(dt);
+	if(player_mode == MINING)
+	{
+		int2 t = mining_target;
+		Ore *o = &ore_map[t.x][t.y];
+		MiningResult r = fast_forward_mining(time_since_last_mined, mining_delay, mining_damage,
+			o->wear, ores[o->type].durability, o->amount, ores[o->type].value, ore_value_multiplier);
+
+		time_since_last_mined = r.time_left;
+		set_ore_state(t.x, t.y, r.amount, r.wear);
+		coins += r.coins;
+		telemetry.ores_mined[o->type] += r.mined;
+		telemetry.coins_earned += r.coins;
+		if(r.mined)
+			prev_amount = r.amount;
+		if(r.depleted)
+		{
+			deplete_ore(t.x, t.y);
+			player_mode = MOVING;
+		}
+		time_since_last_mined += dt;
+	}
+	advance_miners(dt);
+
+	int2 pos;
+	if(touches_stairs(player, &pos)) descend_floor(pos.x, pos.y);
+	else if(touches_entrance(player, &pos)) descend_floor(pos.x, pos.y);
+	else if(touches_upstairs(player)) // up
+		ascend_floor();
+}
+
+void DrawGame(Rectangle shown_player) // shown_player is where the player is drawn, between two steps
+{
+	update_minimap();
+	BeginDrawing();
+	if(depth == 0)
+		ClearBackground(SKYBLUE);
+	else
+		ClearBackground(BLACK);
+
+	Vector2 player_pos = (Vector2){shown_player.x+shown_player.width/2, shown_player.y+shown_player.height/2};
+	camera.target = player_pos;
+
+	BeginMode2D(camera);
+	if(camera.zoom < LOD_OVERVIEW_ZOOM)
+		DrawFloorOverview();
+	else
+	{
+		DrawRectangle(0, 0, MAP_WID, MAP_HEI, tier_colors[tier]);
+		DrawObjectTiles(mining_target, time_since_last_mined);
+	}
+	DrawMiners();
+	DrawRectangleRec(shown_player, RED);
+	DrawCompass(player_pos, STAIRS, GREEN);
+	DrawCompass(player_pos, UPSTAIRS, BLUE);
+	EndMode2D();
+
+	DisplayCoins();
+	DisplayUpgradeCosts();
+	DrawMinimap();
+
+	if(player_mode == MINING)
+	{
+		int2 t = mining_target;
+		DisplayMiningTarget(ore_name, prev_amount);
+		DrawWearBar(ore_map[t.x][t.y].wear, ores[ore_map[t.x][t.y].type].durability);
+	}
+
+	DisplayFloor();
+
+	EndDrawing();
+}
+
+// Telemetry goes out through a shared memory segment, as a seqlock: the
+// counter is odd while the game is copying in a new frame's numbers, so a
+// reader that sees it change(or odd) just reads again. The game never waits
+// on anything, it's one small copy per frame. Each game gets its own
+// segment, named after its pid.
+#define TELEMETRY_NAME "/silver_mountain.%d"
+#define TELEMETRY_MAGIC 0x4d4c4554 // "TELM"
+
+typedef struct
+{
+	unsigned magic, size; // size of the whole thing, so a reader from a different build notices
+	unsigned seq;
+	int pid;
+	Telemetry t;
+} SharedTelemetry;
+SharedTelemetry *shared_telemetry = NULL;
+char telemetry_name[64];
+
+void open_telemetry()
+{
+	snprintf(telemetry_name, sizeof(telemetry_name), TELEMETRY_NAME, getpid());
+	int fd = shm_open(telemetry_name, O_CREAT | O_RDWR, 0644);
+	if(fd < 0) return;
+	if(ftruncate(fd, sizeof(SharedTelemetry)) == 0)
+		shared_telemetry = mmap(NULL, sizeof(SharedTelemetry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shared_telemetry == MAP_FAILED || shared_telemetry == NULL)
+	{
+		shared_telemetry = NULL;
+		return;
+	}
+	shared_telemetry->seq = 0;
+	shared_telemetry->magic = TELEMETRY_MAGIC;
+	shared_telemetry->size = sizeof(SharedTelemetry);
+	shared_telemetry->pid = getpid();
+}
+
+void close_telemetry()
+{
+	if(shared_telemetry == NULL) return;
+	shm_unlink(telemetry_name);
+	munmap(shared_telemetry, sizeof(SharedTelemetry));
+	shared_telemetry = NULL;
+}
+
+void publish_telemetry(float frame_time) // once a frame
+{
+	static long long coins_at[60]; // coins earned so far, at the end of each of the last 60 seconds
+	static long long seconds = 0;
+	static float second_left = 1;
+
+	telemetry.frames++;
+	telemetry.frame_ms = frame_time*1000;
+	if(telemetry.frame_ms > telemetry.worst_frame_ms)
+		telemetry.worst_frame_ms = telemetry.frame_ms;
+	telemetry.mine_floor = mine_floor;
+	telemetry.tier = tier;
+
+	char new_second = 0;
+	second_left -= frame_time;
+	if(second_left <= 0)
+	{
+		new_second = 1;
+		second_left += 1;
+		coins_at[seconds++ % 60] = telemetry.coins_earned;
+		int window = seconds-1 < 59 ? seconds-1 : 59;
+		if(window > 0)
+			telemetry.coins_per_minute = (telemetry.coins_earned - coins_at[(seconds-1 - window) % 60]) * 60.0 / window;
+	}
+
+	if(shared_telemetry != NULL)
+	{
+		unsigned seq = shared_telemetry->seq;
+		__atomic_store_n(&shared_telemetry->seq, seq+1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		shared_telemetry->t = telemetry;
+		__atomic_store_n(&shared_telemetry->seq, seq+2, __ATOMIC_RELEASE);
+	}
+
+	if(new_second) // the worst frame is per second
+		telemetry.worst_frame_ms = 0;
+}
+
+int find_games(char *name, size_t size, char list) // how many games are running; name gets the first one's segment
+{
+	DIR *d = opendir("/dev/shm"); // where Linux keeps them
+	if(d == NULL) return 0;
+	int games = 0, pid;
+	struct dirent *e;
+	while((e = readdir(d)) != NULL)
+	{
+		if(sscanf(e->d_name, "silver_mountain.%d", &pid) != 1) continue;
+		if(kill(pid, 0) != 0 && errno == ESRCH) continue; // left behind by a crash
+		if(games++ == 0) snprintf(name, size, TELEMETRY_NAME, pid);
+		if(list) printf("  pid %d\n", pid);
+	}
+	closedir(d);
+	return games;
+}
+
+int run_watch(int argc, char **argv) // --watch [pid or segment name] [interval in ms], shows a running game's telemetry
+{
+	char name[256];
+	if(argc > 0 && argv[0][0] == '/')
+		snprintf(name, sizeof(name), "%s", argv[0]);
+	else if(argc > 0)
+		snprintf(name, sizeof(name), TELEMETRY_NAME, atoi(argv[0]));
+	else
+	{
+		int games = find_games(name, sizeof(name), 0);
+		if(games == 0)
+		{
+			printf("No game running.\n");
+			return 1;
+		}
+		if(games > 1)
+		{
+			printf("%d games running, pick one with --watch pid:\n", games);
+			find_games(name, sizeof(name), 1);
+			return 1;
+		}
+	}
+	int interval = argc > 1 ? atoi(argv[1]) : 500;
+	if(interval <= 0) interval = 500;
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0)
+	{
+		printf("No game running as %s.\n", name);
+		return 1;
+	}
+	SharedTelemetry *shared = mmap(NULL, sizeof(SharedTelemetry), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shared == MAP_FAILED || shared->magic != TELEMETRY_MAGIC || shared->size != sizeof(SharedTelemetry))
+	{
+		printf("The running game is from a different build.\n");
+		return 1;
+	}
+
+	while(1)
+	{
+		Telemetry t;
+		unsigned seq;
+		do
+		{
+			seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+			t = shared->t;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while((seq & 1) || seq != __atomic_load_n(&shared->seq, __ATOMIC_RELAXED));
+
+		if(kill(shared->pid, 0) != 0 && errno == ESRCH)
+		{
+			printf("The game(pid %d) exited.\n", shared->pid);
+			return 0;
+		}
+
+		printf("\033[H\033[2J"); // clear the terminal
+		printf("Silver Mountain, pid %d\n\n", shared->pid);
+		printf("frame %lld: %.2f ms, worst in the last second %.2f ms\n", t.frames, t.frame_ms, t.worst_frame_ms);
+		printf("floor %d, tier %d, %lld floor transitions\n", t.mine_floor, t.tier, t.floor_transitions);
+		printf("coins earned: %lld, %.0f per minute\n", t.coins_earned, t.coins_per_minute);
+		printf("floor files: %lld bytes written, %lld read\n", t.floor_bytes_written, t.floor_bytes_read);
+		printf("floors generated: %lld, last %.3f ms, average %.3f ms\n", t.floors_generated, t.generate_ms,
+			t.floors_generated ? t.generate_ms_total/t.floors_generated : 0);
+		printf("journal: %lld commits, %lld bytes, %lld checkpoints\n\n", t.journal_commits, t.journal_bytes, t.journal_checkpoints);
+		printf("ores mined:\n");
+		for(int i = 0; i < N_ORES; i++)
+			if(t.ores_mined[i] > 0)
+				printf("  %-12s %lld\n", ores[i].name, t.ores_mined[i]);
+		fflush(stdout);
+		usleep(interval*1000);
+	}
+}
+
+int play() // the game loop; returns 1 if a replay went out of sync
+{
+	double accumulator = 0;
+	Rectangle prev_player = player;
+	double worst_frame = 0, total_time = 0; long long worst_frame_at = 0;
+	char in_sync = 1;
+	while(headless || !WindowShouldClose())
+	{
+		if(replaying)
+		{
+			if(!read_frame(replaying)) break;
+		}
+		else read_input();
+		if(recording) write_frame(recording);
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		float frame_time = input.dt;
+		if(frame_time > MAX_FRAME_TIME) frame_time = MAX_FRAME_TIME;
+		accumulator += frame_time;
+
+		int floor = floors_loaded;
+		handle_input();
+		if(floor != floors_loaded) prev_player = player; // going to a checkpoint
+
+		while(accumulator >= SIM_DT)
+		{
+			prev_player = player;
+			floor = floors_loaded;
+			simulate_step(SIM_DT);
+			if(floor != floors_loaded) prev_player = player; // no sliding in from the last floor's coordinates
+			accumulator -= SIM_DT;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+		total_time += t;
+		if(t > worst_frame) { worst_frame = t; worst_frame_at = rec_frame; }
+		publish_telemetry(headless ? t : input.dt);
+		journal_tick();
+
+		in_sync = end_frame();
+		if(!in_sync) break;
+
+		if(headless) continue;
+		float alpha = accumulator/SIM_DT;
+		Rectangle shown_player = player;
+		shown_player.x = Lerp(prev_player.x, player.x, alpha);
+		shown_player.y = Lerp(prev_player.y, player.y, alpha);
+		DrawGame(shown_player);
+	}
+
+	if(recording || replaying)
+		printf("%lld frames, %.3f ms of game logic per frame, worst frame %.3f ms(frame %lld), state %016llx\n",
+			rec_frame, rec_frame ? 1000*total_time/rec_frame : 0, 1000*worst_frame, worst_frame_at, state_hash());
+	return !in_sync;
+}
+
+// Server mode: one headless process owns the world and runs the simulation,
+// thin clients connect over a local TCP socket. Clients send their input
+// every frame; only the first client to connect gets to play, the rest
+// watch. Every tick the server sends each client a snapshot holding only
+// what changed since the last one that client got.
+//
+// Snapshot: a 4 byte length, then
+//  - a bitmask of which NET_INTS changed, followed by those(zigzag varints)
+//  - a bitmask of which NET_FLOATS changed, followed by those
+//  - runs of changed tiles: skip count, run length, then each tile(and its
+//    ore, for ore tiles), until a run of length 0
+// Which tiles changed comes from each client's cursor into the tile events; a
+// client that just joined, or that's on an older floor, gets all tiles.
+
+enum NET_INTS
+{
+	NET_COINS, NET_SPEED, NET_POWER, NET_SKILL,
+	NET_TIER, NET_FLOOR, NET_DEPTH, NET_MODE, NET_TARGET_X, NET_TARGET_Y,
+	NET_FLOORS_LOADED, NET_WID, NET_HEI, N_NET_INTS
+};
+enum NET_FLOATS {NET_PLAYER_X, NET_PLAYER_Y, NET_MINED_TIME, N_NET_FLOATS};
+
+typedef struct
+{
+	unsigned char *data;
+	int len, capacity;
+} Buffer;
+
+void buf_put(Buffer *b, const void *data, int n)
+{
+	if(b->len + n > b->capacity)
+	{
+		while(b->len + n > b->capacity)
+			b->capacity = b->capacity ? b->capacity*2 : 4096;
+		b->data = realloc(b->data, b->capacity);
+	}
+	memcpy(b->data + b->len, data, n);
+	b->len += n;
+}
+
+void put_varint(Buffer *b, unsigned n)
+{
+	unsigned char bytes[5]; int len = 0;
+	do
+	{
+		bytes[len++] = (n & 127) | (n > 127)<<7;
+		n >>= 7;
+	} while(n);
+	buf_put(b, bytes, len);
+}
+
+void put_int(Buffer *b, int n) { put_varint(b, ((unsigned)n << 1) ^ (n >> 31)); } // zigzag, so small negatives stay small
+
+// The client reads the server's bytes through this; reading past the end,
+// or a varint longer than put_varint() writes, marks them bad
+typedef struct
+{
+	const unsigned char *p, *end;
+	char bad;
+} Reader;
+
+unsigned get_varint(Reader *r)
+{
+	unsigned n = 0;
+	for(int shift = 0; shift < 32 && r->p < r->end; shift += 7)
+	{
+		unsigned char c = *r->p++;
+		if(shift == 28 && c > 15) break; // more than 32 bits
+		n |= (unsigned)(c & 127) << shift;
+		if(!(c & 128)) return n;
+	}
+	r->bad = 1;
+	return 0;
+}
+
+int get_int(Reader *r) { unsigned n = get_varint(r); return (n >> 1) ^ -(int)(n & 1); }
+
+float get_float(Reader *r)
+{
+	float f = 0;
+	if(r->end - r->p < (long)sizeof(f)) { r->bad = 1; return f; }
+	memcpy(&f, r->p, sizeof(f)); r->p += sizeof(f);
+	return f;
+}
+
+void gather_net_values(int *ints, float *floats)
+{
+	ints[NET_COINS] = coins;
+	ints[NET_SPEED] = mining_speed;
+	ints[NET_POWER] = mining_power;
+	ints[NET_SKILL] = mining_skill;
+	ints[NET_TIER] = tier;
+	ints[NET_FLOOR] = mine_floor;
+	ints[NET_DEPTH] = depth;
+	ints[NET_MODE] = player_mode;
+	ints[NET_TARGET_X] = mining_target.x;
+	ints[NET_TARGET_Y] = mining_target.y;
+	ints[NET_FLOORS_LOADED] = floors_loaded;
+	ints[NET_WID] = object_tiles.wid;
+	ints[NET_HEI] = object_tiles.hei;
+
+	floats[NET_PLAYER_X] = player.x;
+	floats[NET_PLAYER_Y] = player.y;
+	floats[NET_MINED_TIME] = time_since_last_mined;
+}
+
+// What a client mirrors; the loopback test checks that both ends agree on it
+unsigned long long mirror_hash()
+{
+	int ints[N_NET_INTS]; float floats[N_NET_FLOATS];
+	gather_net_values(ints, floats);
+	ints[NET_FLOORS_LOADED] = 0; // counted separately on each end
+
+	unsigned long long h = 14695981039346656037ULL;
+	HASH_VAR(h, ints); HASH_VAR(h, floats);
+	for(int x = 0; x < object_tiles.wid; x++)
+	for(int y = 0; y < object_tiles.hei; y++)
+	{
+		HASH_VAR(h, object_tiles.tiles[x][y]);
+		if(object_tiles.tiles[x][y] == ORE)
+		{
+			HASH_VAR(h, ore_map[x][y].type);
+			HASH_VAR(h, ore_map[x][y].amount);
+			HASH_VAR(h, ore_map[x][y].wear);
+		}
+	}
+	return h;
+}
+
+#define NET_INPUT_SIZE 14 // keys, click position and wheel
+
+typedef struct
+{
+	int fd;
+	TileCursor cursor; // the tile changes it has been sent
+	int ints[N_NET_INTS];
+	float floats[N_NET_FLOATS];
+	char joined; // got its first snapshot
+	unsigned char in[NET_INPUT_SIZE]; int in_len;
+} NetClient;
+
+#define MAX_CLIENTS 16
+NetClient clients[MAX_CLIENTS];
+int nclients = 0;
+Buffer snapshot = {0};
+int *changed_tiles = NULL; char *changed_mark = NULL; int changed_size = 0; // for write_snapshot()
+
+int compare_ints(const void *a, const void *b) { return *(const int*)a - *(const int*)b; }
+
+void write_snapshot(Buffer *b, NetClient *c)
+{
+	int ints[N_NET_INTS]; float floats[N_NET_FLOATS];
+	gather_net_values(ints, floats);
+	int wid = object_tiles.wid, hei = object_tiles.hei;
+	if(changed_size < wid*hei)
+	{
+		changed_size = wid*hei;
+		changed_tiles = realloc(changed_tiles, sizeof(int)*changed_size);
+		changed_mark = realloc(changed_mark, changed_size);
+		memset(changed_mark, 0, changed_size);
+	}
+
+	int nchanged = 0; // tile indexes(x*hei + y), in order
+	if(!c->joined || tile_events_lost(&c->cursor))
+	{ // a new floor: everything is different
+		for(int i = 0; i < wid*hei; i++)
+			changed_tiles[nchanged++] = i;
+		skip_tile_events(&c->cursor);
+	}
+	else
+	{
+		for(TileEvent *e; (e = next_tile_event(&c->cursor)) != NULL; )
+		{
+			int i = e->x*hei + e->y;
+			if(changed_mark[i]) continue; // changed more than once, it's sent as it is now
+			changed_mark[i] = 1;
+			changed_tiles[nchanged++] = i;
+		}
+		for(int i = 0; i < nchanged; i++)
+			changed_mark[changed_tiles[i]] = 0;
+		qsort(changed_tiles, nchanged, sizeof(int), compare_ints);
+	}
+
+	b->len = 0;
+	unsigned len = 0;
+	buf_put(b, &len, sizeof(len)); // filled in at the end
+
+	unsigned mask = 0;
+	for(int i = 0; i < N_NET_INTS; i++)
+		if(!c->joined || ints[i] != c->ints[i]) mask |= 1 << i;
+	put_varint(b, mask);
+	for(int i = 0; i < N_NET_INTS; i++)
+		if(mask & 1 << i) put_int(b, c->ints[i] = ints[i]);
+
+	mask = 0;
+	for(int i = 0; i < N_NET_FLOATS; i++)
+		if(!c->joined || floats[i] != c->floats[i]) mask |= 1 << i;
+	put_varint(b, mask);
+	for(int i = 0; i < N_NET_FLOATS; i++)
+		if(mask & 1 << i)
+		{
+			c->floats[i] = floats[i];
+			buf_put(b, &floats[i], sizeof(float));
+		}
+
+	int end = 0; // just past the last run
+	for(int k = 0; k < nchanged; )
+	{
+		int run = 1;
+		while(k+run < nchanged && changed_tiles[k+run] == changed_tiles[k]+run) run++;
+		put_varint(b, changed_tiles[k] - end);
+		put_varint(b, run);
+		for(int j = changed_tiles[k]; j < changed_tiles[k]+run; j++)
+		{
+			int x = j/hei, y = j%hei;
+			put_varint(b, object_tiles.tiles[x][y]);
+			if(object_tiles.tiles[x][y] == ORE)
+			{
+				Ore *o = &ore_map[x][y];
+				put_varint(b, o->type);
+				put_varint(b, o->amount);
+				buf_put(b, &o->wear, sizeof(o->wear));
+			}
+		}
+		end = changed_tiles[k] + run;
+		k += run;
+	}
+	put_varint(b, 0); put_varint(b, 0);
+
+	len = b->len - sizeof(len);
+	memcpy(b->data, &len, sizeof(len));
+	c->joined = 1;
+}
+
+#define NET_MAX_SIDE 4096 // the biggest floor a client takes from a server
+
+char check_net_values(int *ints)
+{
+	int wid = ints[NET_WID], hei = ints[NET_HEI];
+	if(wid <= 0 || hei <= 0 || wid > NET_MAX_SIDE || hei > NET_MAX_SIDE) return 0;
+	for(int i = NET_SPEED; i <= NET_SKILL; i++)
+		if(ints[i] < 0 || ints[i] > 1<<14) return 0; // upgrade_cost() squares them
+	if(ints[NET_TIER] < 0 || ints[NET_TIER] > MAX_TIERS) return 0; // 0 is the surface
+	if(ints[NET_MODE] != MOVING && ints[NET_MODE] != MINING) return 0;
+	if(ints[NET_MODE] == MINING && (ints[NET_TARGET_X] < 0 || ints[NET_TARGET_X] >= wid ||
+		ints[NET_TARGET_Y] < 0 || ints[NET_TARGET_Y] >= hei)) return 0;
+	return 1;
+}
+
+char check_tiles(Reader r, int wid, int hei) // a dry run over the tile runs, on a copy of the reader
+{
+	long long i = 0, n = (long long)wid*hei;
+	for(;;)
+	{
+		i += get_varint(&r);
+		unsigned run = get_varint(&r);
+		if(r.bad) return 0;
+		if(run == 0) return 1;
+		if(i + run > n) return 0;
+		for(unsigned j = 0; j < run; j++)
+		{
+			unsigned tile = get_varint(&r);
+			if(tile >= N_OBJECTS) return 0;
+			if(tile == ORE)
+			{
+				unsigned type = get_varint(&r), amount = get_varint(&r);
+				get_float(&r);
+				if(type >= N_ORES || amount > INT_MAX) return 0;
+			}
+			if(r.bad) return 0;
+		}
+		i += run;
+	}
+}
+
+char apply_snapshot(const unsigned char *p, unsigned len) // client side; returns 0, having changed nothing, if it's bad
+{
+	Reader r = {p, p + len, 0};
+	int ints[N_NET_INTS]; float floats[N_NET_FLOATS];
+	gather_net_values(ints, floats);
+	int old_floor = floors_loaded;
+
+	unsigned mask = get_varint(&r);
+	for(int i = 0; i < N_NET_INTS; i++)
+		if(mask & 1 << i) ints[i] = get_int(&r);
+	mask = get_varint(&r);
+	for(int i = 0; i < N_NET_FLOATS; i++)
+		if(mask & 1 << i) floats[i] = get_float(&r);
+	if(r.bad || !check_net_values(ints) || !check_tiles(r, ints[NET_WID], ints[NET_HEI]))
+		return 0;
+
+	coins = ints[NET_COINS];
+	if(ints[NET_SPEED] != mining_speed || ints[NET_POWER] != mining_power || ints[NET_SKILL] != mining_skill)
+	{
+		mining_speed = ints[NET_SPEED]; mining_delay = speed_to_delay(mining_speed);
+		mining_power = ints[NET_POWER]; mining_damage = power_to_damage(mining_power);
+		mining_skill = ints[NET_SKILL]; ore_value_multiplier = skill_to_multiplier(mining_skill);
+		total_level = mining_speed + mining_power + mining_skill;
+		update_upgrade_costs();
+	}
+	ores[SEAL].durability = mining_damage*2; // simulate_step() sets it on the server, DrawWearBar() divides by it
+	tier = ints[NET_TIER];
+	mine_floor = ints[NET_FLOOR];
+	depth = ints[NET_DEPTH];
+	player_mode = ints[NET_MODE];
+	mining_target = (int2){ints[NET_TARGET_X], ints[NET_TARGET_Y]};
+	floors_loaded = ints[NET_FLOORS_LOADED];
+	if(ints[NET_WID] != object_tiles.wid || ints[NET_HEI] != object_tiles.hei)
+		allocate_floor(ints[NET_WID], ints[NET_HEI]);
+
+	player.x = floats[NET_PLAYER_X];
+	player.y = floats[NET_PLAYER_Y];
+	time_since_last_mined = floats[NET_MINED_TIME];
+
+	char new_floor = floors_loaded != old_floor;
+	int hei = object_tiles.hei;
+	for(int i = 0; ; )
+	{
+		i += get_varint(&r);
+		int run = get_varint(&r);
+		if(run == 0) break;
+		for(int j = i; j < i+run; j++)
+		{
+			int x = j/hei, y = j%hei, tile = get_varint(&r);
+			if(tile == ORE)
+			{
+				int type = get_varint(&r), amount = get_varint(&r);
+				set_ore(x, y, type, amount, get_float(&r), 0);
+			}
+			else set_tile(x, y, tile);
+		}
+		i += run;
+	}
+	if(new_floor)
+	{
+		floor_replaced();
+		build_distance_fields();
+	}
+
+	if(player_mode == MINING)
+	{
+		Ore *o = &ore_map[mining_target.x][mining_target.y];
+		ore_name = ores[o->type].name;
+		prev_amount = o->amount;
+	}
+	return 1;
+}
+
+volatile sig_atomic_t stop_server = 0;
+void on_interrupt(int sig) { stop_server = 1; }
+
+int listen_on(int port) // on the loopback address only; 0 picks a free port
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int yes = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, MAX_CLIENTS) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+int connect_to(const char *host, const char *port)
+{
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *res;
+	if(getaddrinfo(host, port, &hints, &res) != 0) return -1;
+	int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if(fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if(fd >= 0)
+	{
+		int yes = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	}
+	return fd;
+}
+
+char send_all(int fd, const void *data, int n)
+{
+	const char *p = data;
+	while(n > 0)
+	{
+		int sent = send(fd, p, n, MSG_NOSIGNAL);
+		if(sent <= 0) return 0;
+		p += sent; n -= sent;
+	}
+	return 1;
+}
+
+void drop_client(int i)
+{
+	close(clients[i].fd);
+	for(int j = i; j < nclients-1; j++) // keep the order, the oldest client is the one playing
+		clients[j] = clients[j+1];
+	nclients--;
+}
+
+void accept_clients(int listener)
+{
+	int fd;
+	while(nclients < MAX_CLIENTS && (fd = accept(listener, NULL, NULL)) >= 0)
+	{
+		int yes = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		clients[nclients++] = (NetClient){.fd = fd};
+	}
+}
+
+void receive_inputs(FrameInput *in) // merges whatever the playing client sent since the last tick
+{
+	for(int i = 0; i < nclients; i++)
+	{
+		NetClient *c = &clients[i];
+		int got;
+		while((got = recv(c->fd, c->in + c->in_len, NET_INPUT_SIZE - c->in_len, MSG_DONTWAIT)) > 0)
+		{
+			c->in_len += got;
+			if(c->in_len < NET_INPUT_SIZE) continue;
+			c->in_len = 0;
+			if(i != 0) continue; // spectators don't get a say
+
+			unsigned short keys;
+			memcpy(&keys, c->in, sizeof(keys));
+			in->keys = (in->keys & ~((1<<HELD_BITS)-1)) | keys; // held keys are the latest, presses add up
+			if(keys & 1 << IN_CLICK) memcpy(&in->mouse, c->in + 2, sizeof(in->mouse));
+			float wheel;
+			memcpy(&wheel, c->in + 10, sizeof(wheel));
+			in->wheel += wheel;
+		}
+		if(got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+			drop_client(i--);
+	}
+}
+
+void send_input(int fd)
+{
+	unsigned char msg[NET_INPUT_SIZE];
+	memcpy(msg, &input.keys, sizeof(input.keys));
+	memcpy(msg + 2, &input.mouse, sizeof(input.mouse));
+	memcpy(msg + 10, &input.wheel, sizeof(input.wheel));
+	send_all(fd, msg, sizeof(msg));
+}
+
+// Runs the world at SIM_RATE ticks per second until interrupted, or for a set
+// number of ticks. As a loopback test(client_pipe != -1) it ticks as fast as
+// it can for the one client, and checks that client's copy of the world at
+// the end.
+int run_server(int listener, long long max_ticks, int client_pipe)
+{
+	signal(SIGINT, on_interrupt);
+	char loopback = client_pipe != -1;
+	if(loopback)
+	{
+		struct pollfd p = {.fd = listener, .events = POLLIN};
+		poll(&p, 1, 5000); // wait for the client
+		accept_clients(listener);
+	}
+
+	struct timespec start, now, next_tick;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next_tick = start;
+	double report_at = 1, last_tick = 0;
+	long long ticks = 0, report_ticks = 0, bytes = 0, report_bytes = 0;
+	FrameInput in = {0};
+
+	while(!stop_server && (max_ticks == 0 || ticks < max_ticks) && (!loopback || nclients > 0))
+	{
+		accept_clients(listener);
+		receive_inputs(&in);
+
+		input = in;
+		handle_input();
+		simulate_step(SIM_DT);
+		in.keys &= (1<<HELD_BITS)-1;
+		in.wheel = 0;
+
+		for(int i = 0; i < nclients; i++)
+		{
+			write_snapshot(&snapshot, &clients[i]);
+			bytes += snapshot.len;
+			if(!send_all(clients[i].fd, snapshot.data, snapshot.len))
+				drop_client(i--);
+		}
+		ticks++;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double t = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec)/1e9;
+		publish_telemetry(t - last_tick);
+		journal_tick();
+		last_tick = t;
+		if(!loopback && t >= report_at)
+		{
+			printf("%lld ticks/s, %.1f bytes/tick per client, %d client(s)\n", ticks - report_ticks,
+				nclients ? (double)(bytes - report_bytes)/(ticks - report_ticks)/nclients : 0, nclients);
+			fflush(stdout);
+			report_ticks = ticks; report_bytes = bytes;
+			report_at = t + 1;
+		}
+
+		if(!loopback) // hold the tick rate
+		{
+			next_tick.tv_nsec += 1000000000/SIM_RATE;
+			if(next_tick.tv_nsec >= 1000000000) { next_tick.tv_sec++; next_tick.tv_nsec -= 1000000000; }
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, NULL);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double t = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec)/1e9;
+	printf("%lld ticks in %.2f s: %.0f ticks/s, %.1f bytes/tick\n", ticks, t, ticks/t, ticks ? (double)bytes/ticks : 0);
+
+	int result = 0;
+	if(loopback)
+	{
+		while(nclients > 0) drop_client(0); // the client sees the end of the stream
+		unsigned long long client_hash = 0, server_hash = mirror_hash();
+		read(client_pipe, &client_hash, sizeof(client_hash));
+		wait(NULL);
+		result = client_hash != server_hash;
+		printf("Client's copy of the world %s(%016llx, server %016llx).\n",
+			result ? "DIFFERS" : "matches", client_hash, server_hash);
+	}
+	close(listener);
+	return result;
+}
+
+// Keeps the globals in sync with the server's snapshots. Returns 0 once the
+// server is gone.
+char receive_snapshots(int fd, Buffer *b, char wait)
+{
+	char buf[65536];
+	int got = recv(fd, buf, sizeof(buf), wait ? 0 : MSG_DONTWAIT);
+	if(got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) return 0;
+	if(got > 0) buf_put(b, buf, got);
+
+	int done = 0;
+	unsigned len;
+	while(b->len - done >= (int)sizeof(len))
+	{
+		memcpy(&len, b->data + done, sizeof(len));
+		if(b->len - done - sizeof(len) < len) break;
+		if(!apply_snapshot(b->data + done + sizeof(len), len))
+		{
+			printf("Got a bad snapshot from the server.\n");
+			return 0;
+		}
+		done += sizeof(len) + len;
+	}
+	memmove(b->data, b->data + done, b->len - done);
+	b->len -= done;
+	return 1;
+}
+
+int run_client(int argc, char **argv) // --client host port
+{
+	if(argc < 2)
+	{
+		printf("Usage: --client host port\n");
+		return 1;
+	}
+	int fd = connect_to(argv[0], argv[1]);
+	if(fd < 0)
+	{
+		printf("Couldn't connect to %s:%s.\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	InitWindow(WID, HEI, "Silver Mountain");
+	SetTargetFPS(60);
+	camera.offset = (Vector2){WID/2, HEI/2};
+	camera.zoom = 1.0;
+	object_tiles.wid = object_tiles.hei = 0;
 
+	Buffer in = {0};
+	while(!WindowShouldClose() && receive_snapshots(fd, &in, 0))
+	{
+		read_input();
+		send_input(fd);
+		if(object_tiles.wid > 0)
+			DrawGame(player);
+	}
+	close(fd);
+	UnloadHud();
+	UnloadTexture(minimap);
 	CloseWindow();
+	return 0;
+}
+
+void loopback_client(int fd, int result_pipe) // a stand-in player for the loopback test
+{
+	headless = 1;
+	object_tiles.wid = object_tiles.hei = 0;
+	floors_loaded = -1;
+
+	Buffer in = {0};
+	unsigned rng = 12345;
+	for(int frame = 0; receive_snapshots(fd, &in, 1); frame++)
+	{
+		rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+		input.keys = 0;
+		if(frame % 600 < 300) // wander around and mine what's in reach
+		{
+			if(frame/30 % 3) input.keys = 1 << (rng>>28 & 3);
+			else if(rng % 7 == 0)
+			{
+				input.keys |= 1 << IN_CLICK;
+				input.mouse = (Vector2){player.x + player.width/2 + (int)(rng%3 - 1)*SCALE,
+					player.y + player.height/2 + (int)(rng/3%3 - 1)*SCALE};
+			}
+		}
+		else if(frame % 600 == 300) // then head down, or back up now and then
+			input.keys = 1 << (depth == 0 ? IN_NAV_ENTRANCE : rng % 4 ? IN_NAV_STAIRS : IN_NAV_UPSTAIRS);
+		send_input(fd);
+	}
+	unsigned long long h = mirror_hash();
+	write(result_pipe, &h, sizeof(h));
+	_exit(0);
+}
+
+int start_loopback(int *pipe_out) // forks the client; returns the listening socket
+{
+	int listener = listen_on(0);
+	if(listener < 0) return -1;
+	struct sockaddr_in addr; socklen_t addrlen = sizeof(addr);
+	getsockname(listener, (struct sockaddr*)&addr, &addrlen);
+	char port[16];
+	snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+
+	int fds[2];
+	if(pipe(fds) != 0)
+	{
+		close(listener);
+		return -1;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid < 0)
+	{
+		close(fds[0]); close(fds[1]);
+		close(listener);
+		return -1;
+	}
+	if(pid == 0)
+	{
+		close(listener);
+		close(fds[0]);
+		int fd = connect_to("127.0.0.1", port);
+		if(fd < 0) _exit(1);
+		loopback_client(fd, fds[1]);
+	}
+	close(fds[1]);
+	*pipe_out = fds[0];
+	return listener;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *seedfile;
+
+	seedfile = fopen("seed.txt", "r");
+	if(seedfile != NULL) // if file exists
+	{
+		fscanf(seedfile, "%d", &worldseed);
+		printf("World seed set to %d.\n", worldseed);
+		fclose(seedfile);
+	}
+
+	if(argc > 1 && !strcmp(argv[1], "--simulate"))
+		return run_simulator(argc-2, argv+2);
+	if(argc > 1 && !strcmp(argv[1], "--seeds"))
+		return run_seed_analytics(argc-2, argv+2);
+	if(argc > 1 && !strcmp(argv[1], "--client"))
+		return run_client(argc-2, argv+2);
+	if(argc > 1 && !strcmp(argv[1], "--vein-bench"))
+		return run_vein_bench(argc-2, argv+2);
+	if(argc > 1 && !strcmp(argv[1], "--miner-bench"))
+		return run_miner_bench(argc-2, argv+2);
+	if(argc > 1 && !strcmp(argv[1], "--watch"))
+		return run_watch(argc-2, argv+2);
+
+	int fps = 60; // 0 for uncapped
+	char vsync = 0;
+	char *record_file = NULL, *replay_file = NULL;
+	int server_port = -1; long long server_ticks = 0; char loopback = 0;
+	for(int i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "--fps") && i+1 < argc) // --fps N, --fps vsync or --fps uncapped
+		{
+			i++;
+			if(!strcmp(argv[i], "vsync")) { vsync = 1; fps = 0; }
+			else if(!strcmp(argv[i], "uncapped")) fps = 0;
+			else fps = atoi(argv[i]);
+		}
+		else if(!strcmp(argv[i], "--record") && i+1 < argc) // --record file
+			record_file = argv[++i];
+		else if(!strcmp(argv[i], "--replay") && i+1 < argc) // --replay file [--headless]
+			replay_file = argv[++i];
+		else if(!strcmp(argv[i], "--headless"))
+			headless = 1;
+		else if(!strcmp(argv[i], "--server") && i+1 < argc) // --server port [--ticks N]
+			server_port = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--ticks") && i+1 < argc)
+			server_ticks = atoll(argv[++i]);
+		else if(!strcmp(argv[i], "--loopback")) // --loopback [--ticks N], a server with a stand-in client
+			loopback = 1;
+		else if(!strcmp(argv[i], "--veins")) // new floors get ore veins
+			ore_veins = 1;
+	}
+	if(server_port >= 0 || loopback) headless = 1;
+	else if(replay_file == NULL) headless = 0;
+
+	char cwd[4000];
+	if(getcwd(cwd, sizeof(cwd)) != NULL)
+	{
+		snprintf(player_file, sizeof(player_file), "%s/player.dat", cwd);
+		snprintf(journal_file, sizeof(journal_file), "%s/journal.dat", cwd);
+	}
+	// the journal only covers normal play on the real save; recordings and the
+	// loopback test play on a scratch copy, and a server doesn't journal either
+	char normal_play = !record_file && !replay_file && !loopback && server_port < 0;
+	if(normal_play)
+	{
+		int recovered = recover_journal();
+		if(recovered > 0)
+			printf("Recovered %d unsaved changes from the journal.\n", recovered);
+	}
+
+	if(replay_file)
+	{
+		replaying = fopen(replay_file, "rb");
+		if(replaying == NULL || !read_recording_header(replaying))
+		{
+			printf("Couldn't read recording %s.\n", replay_file);
+			return 1;
+		}
+	}
+	else if(record_file)
+	{
+		load_player_data(); // the recording starts out with the player's coins, upgrades and checkpoints
+		recording = fopen(record_file, "wb");
+		if(recording == NULL)
+		{
+			printf("Couldn't write recording %s.\n", record_file);
+			return 1;
+		}
+		write_recording_header(recording);
+	}
+	if(recording || replaying || loopback)
+	{
+		if(mkdtemp(scratch_dir) == NULL || chdir(scratch_dir) != 0)
+		{
+			printf("Couldn't make a scratch directory.\n");
+			return 1;
+		}
+	}
+
+	int listener = -1, client_pipe = -1;
+	if(loopback)
+	{
+		if(server_ticks == 0) server_ticks = 10*SIM_RATE*60;
+		listener = start_loopback(&client_pipe);
+	}
+	else if(server_port >= 0)
+	{
+		listener = listen_on(server_port);
+		if(listener >= 0) printf("Serving on port %d.\n", server_port);
+	}
+	if((loopback || server_port >= 0) && listener < 0)
+	{
+		printf("Couldn't open the server socket.\n");
+		return 1;
+	}
+
+	if(!headless)
+	{
+		if(vsync)
+			SetConfigFlags(FLAG_VSYNC_HINT);
+		InitWindow(WID, HEI, "Silver Mountain");
+		SetTargetFPS(fps);
+	}
+
+	allocate_floor(100, 100);
+
+	generate_floor(); // Because the depth is 0, it will generate the surface "floor"
+	save_floor();
+	floor_loaded();
+
+	camera.offset = (Vector2){WID/2, HEI/2};
+	camera.rotation = 0;
+	camera.zoom = 1.0;
+
+	if(!recording && !replaying)
+		load_player_data();
+	// if there is no player data, leaves the default values
+	update_upgrade_costs();
+
+	if(normal_play)
+		open_journal(); // from here on, progress survives a crash
+
+	open_telemetry();
+	int result;
+	if(listener >= 0)
+		result = run_server(listener, server_ticks, client_pipe);
+	else
+		result = play();
+
+	save_floor();
+	// make sure to save the floor when exiting the game,
+	// and not just when we're leaving it for another floor
+
+	while(depth-- > 0) chdir("..");
+	// make sure we're at the top directory before we
+	// write the save file
+
+	if(recording || replaying || client_pipe != -1)
+	{
+		if(recording) fclose(recording);
+		if(replaying) fclose(replaying);
+		remove_tree(scratch_dir);
+	}
+	else save_player_data();
+	close_journal();
+
+	close_telemetry();
+	if(!headless)
+	{
+		UnloadHud();
+		UnloadTexture(minimap);
+		CloseWindow();
+	}
+	return result;
 }